@@ -0,0 +1,75 @@
+// bitpack.cpp
+// Source file for the variable bit width packing of small residuals, a fast
+// alternative to LZSS for noisy data of a low dynamic range.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "bitpack.hpp"
+
+// Every group starts with a byte giving its bit width 0-8, the residuals
+// are zigzag mapped so small magnitudes of either sign need few bits
+// The group is stored as bit planes, one 4-byte little-endian word per bit
+// of the width starting with the lowest one, bit i of a word belongs to
+// the i-th value of the group
+// The loops over a group have a fixed count and no branches, so they vectorize
+#define BITPACK_MAX_WIDTH 8
+#define BITPACK_PLANE_SIZE (BITPACK_GROUP_SIZE / 8)
+
+size_t bitpack_encode(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output) {
+    size_t start = output.size();
+    uint8_t zigzag[BITPACK_GROUP_SIZE];
+    for (size_t pos = 0; pos + BITPACK_GROUP_SIZE <= input_size; pos += BITPACK_GROUP_SIZE) {
+        uint8_t used_bits = 0;
+        for (size_t i = 0; i < BITPACK_GROUP_SIZE; i++) {
+            uint8_t value = input[pos + i];
+            zigzag[i] = (uint8_t)(value << 1) ^ (uint8_t)-(value >> 7);
+            used_bits |= zigzag[i];
+        }
+        uint8_t width = 0;
+        while ((used_bits >> width) != 0) {
+            width++;
+        }
+
+        output.push_back(width);
+        for (uint8_t bit = 0; bit < width; bit++) {
+            uint32_t plane = 0;
+            for (size_t i = 0; i < BITPACK_GROUP_SIZE; i++) {
+                plane |= (uint32_t)((zigzag[i] >> bit) & 1) << i;
+            }
+            for (int shift = 0; shift < 32; shift += 8) {
+                output.push_back((plane >> shift) & 0xFF);
+            }
+        }
+    }
+    return output.size() - start;
+}
+
+size_t bitpack_decode(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output) {
+    size_t start = output.size();
+    uint8_t zigzag[BITPACK_GROUP_SIZE];
+    for (size_t pos = 0; pos < input_size;) {
+        uint8_t width = input[pos++];
+        if (width > BITPACK_MAX_WIDTH || input_size - pos < width * BITPACK_PLANE_SIZE) {
+            output.resize(start);
+            return 0;
+        }
+
+        for (size_t i = 0; i < BITPACK_GROUP_SIZE; i++) {
+            zigzag[i] = 0;
+        }
+        for (uint8_t bit = 0; bit < width; bit++, pos += BITPACK_PLANE_SIZE) {
+            uint32_t plane = input[pos] | input[pos + 1] << 8 | input[pos + 2] << 16 | (uint32_t)input[pos + 3] << 24;
+            for (size_t i = 0; i < BITPACK_GROUP_SIZE; i++) {
+                zigzag[i] |= ((plane >> i) & 1) << bit;
+            }
+        }
+
+        size_t group = output.size();
+        output.resize(group + BITPACK_GROUP_SIZE);
+        for (size_t i = 0; i < BITPACK_GROUP_SIZE; i++) {
+            output[group + i] = (zigzag[i] >> 1) ^ -(zigzag[i] & 1);
+        }
+    }
+    return output.size() - start;
+}
@@ -0,0 +1,29 @@
+// bitpack.hpp
+// Header file for the variable bit width packing of small residuals, a fast
+// alternative to LZSS for noisy data of a low dynamic range.
+
+#ifndef BITPACK_HPP
+#define BITPACK_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Number of values sharing a bit width
+#define BITPACK_GROUP_SIZE 32
+
+// Pack signed byte residuals at the bit width of every group
+// input: pointer to the residuals, size must be a multiple of BITPACK_GROUP_SIZE
+// input_size: number of residuals
+// output: vector the packed data is appended to
+// Returns the size of the packed data
+size_t bitpack_encode(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output);
+
+// Unpack residuals packed by bitpack_encode
+// input: pointer to the packed data
+// input_size: size of the packed data
+// output: vector the residuals are appended to
+// Returns the number of unpacked residuals, 0 if the input is invalid
+size_t bitpack_decode(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output);
+
+#endif
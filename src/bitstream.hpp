@@ -0,0 +1,86 @@
+// bitstream.hpp
+// Header file for the bit writer and reader used by the entropy stage,
+// bits are packed MSB first.
+
+#ifndef BITSTREAM_HPP
+#define BITSTREAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class BitWriter {
+public:
+    BitWriter(std::vector<uint8_t>& output) : output(output), buffer(0), count(0) {}
+
+    // Append the lowest len bits of value, len can be at most 32
+    void put(uint32_t value, unsigned len) {
+        buffer = (buffer << len) | (value & ((uint64_t(1) << len) - 1));
+        count += len;
+        while (count >= 8) {
+            count -= 8;
+            output.push_back((buffer >> count) & 0xFF);
+        }
+    }
+
+    // Write out the remaining bits, padding the last byte with zeros
+    void flush() {
+        if (count > 0) {
+            output.push_back((buffer << (8 - count)) & 0xFF);
+            count = 0;
+        }
+        buffer = 0;
+    }
+
+private:
+    std::vector<uint8_t>& output;
+    uint64_t buffer;
+    unsigned count;
+};
+
+class BitReader {
+public:
+    BitReader(const uint8_t* input, size_t input_size)
+        : input(input), input_size(input_size), pos(0), buffer(0), count(0) {}
+
+    // Top up the buffer to at least 57 bits, reading past the end gives zeros
+    void refill() {
+        while (count <= 56) {
+            uint64_t byte = pos < input_size ? input[pos] : 0;
+            buffer |= byte << (56 - count);
+            pos++;
+            count += 8;
+        }
+    }
+
+    // Look at the next len bits without consuming them, len can be at most 32
+    // and the buffer must have been refilled
+    uint32_t peek(unsigned len) const {
+        return len ? buffer >> (64 - len) : 0;
+    }
+
+    void consume(unsigned len) {
+        buffer <<= len;
+        count -= len;
+    }
+
+    uint32_t get(unsigned len) {
+        refill();
+        uint32_t value = peek(len);
+        consume(len);
+        return value;
+    }
+
+    // True if more bits were consumed than the input holds
+    bool overrun() const {
+        return pos * 8 - count > input_size * 8;
+    }
+
+private:
+    const uint8_t* input;
+    size_t input_size, pos;
+    uint64_t buffer;
+    unsigned count;
+};
+
+#endif
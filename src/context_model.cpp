@@ -0,0 +1,315 @@
+// context_model.cpp
+// Source file for the context modeling codec, which predicts every pixel from
+// its causal neighbours and codes the residuals with an adaptive binary
+// arithmetic coder, used instead of LZSS for the best compression ratio.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include "context_model.hpp"
+
+// The compressed stream starts with the pixel count (4 bytes, little-endian)
+// followed by the output of the range coder
+// Every pixel is predicted by the MED predictor of JPEG-LS and corrected by
+// the bias of its context, the context is given by the quantized local
+// gradients and folded so that opposite gradients share it
+// The residual, zigzag mapped to 0-255, is coded as its bit length in unary
+// and the bits below the highest one as a bit tree, both with probabilities
+// chosen by the activity class, which is the Golomb parameter JPEG-LS
+// would use for the context
+#define CM_PIXEL_COUNT_SIZE 4
+#define CM_PROB_BITS 11
+#define CM_PROB_INIT (1 << (CM_PROB_BITS - 1))
+#define CM_ADAPT_SHIFT 5
+#define CM_RANGE_TOP (1u << 24)
+#define CM_GRADIENT_LEVELS 9
+#define CM_CONTEXTS ((CM_GRADIENT_LEVELS * CM_GRADIENT_LEVELS * CM_GRADIENT_LEVELS + 1) / 2)
+#define CM_CLASSES 8
+#define CM_MAGNITUDES 9
+#define CM_MANTISSA_NODES 128
+#define CM_RESET 64
+#define CM_T1 3
+#define CM_T2 7
+#define CM_T3 21
+#define CM_MIN_CORRECTION -128
+#define CM_MAX_CORRECTION 127
+
+// Adaptive statistics of a context, A, B, C and N of JPEG-LS
+struct ContextStats {
+    int magnitude_sum = 4;
+    int bias_sum = 0;
+    int correction = 0;
+    int count = 1;
+};
+
+struct Model {
+    ContextStats contexts[CM_CONTEXTS];
+    uint16_t magnitude[CM_CLASSES][CM_MAGNITUDES];
+    uint16_t mantissa[CM_CLASSES][CM_MAGNITUDES][CM_MANTISSA_NODES];
+
+    Model() {
+        std::fill(&magnitude[0][0], &magnitude[0][0] + sizeof(magnitude) / sizeof(uint16_t), CM_PROB_INIT);
+        std::fill(&mantissa[0][0][0], &mantissa[0][0][0] + sizeof(mantissa) / sizeof(uint16_t), CM_PROB_INIT);
+    }
+};
+
+// Prediction of a pixel and the context it is coded in
+struct PixelContext {
+    ContextStats* stats;
+    int prediction;
+    int sign;
+    size_t activity;
+};
+
+// Binary range encoder with carry propagation, probabilities are
+// of the bit being 0 and adapt towards every coded bit
+class RangeEncoder {
+public:
+    RangeEncoder(std::vector<uint8_t>& output) : output(output), low(0), range(0xFFFFFFFF), cache(0), cache_size(1) {}
+
+    void encode(uint16_t& prob, int bit) {
+        uint32_t bound = (range >> CM_PROB_BITS) * prob;
+        if (bit == 0) {
+            range = bound;
+            prob += ((1 << CM_PROB_BITS) - prob) >> CM_ADAPT_SHIFT;
+        } else {
+            low += bound;
+            range -= bound;
+            prob -= prob >> CM_ADAPT_SHIFT;
+        }
+        while (range < CM_RANGE_TOP) {
+            range <<= 8;
+            shift_low();
+        }
+    }
+
+    void flush() {
+        for (int i = 0; i < 5; i++) {
+            shift_low();
+        }
+    }
+
+private:
+    std::vector<uint8_t>& output;
+    uint64_t low;
+    uint32_t range;
+    uint8_t cache;
+    size_t cache_size;
+
+    // Output the top byte of low, bytes of 0xFF are held back
+    // until it is known whether a carry reaches them
+    void shift_low() {
+        if ((uint32_t)low < 0xFF000000 || (low >> 32) != 0) {
+            uint8_t carry = low >> 32;
+            uint8_t byte = cache;
+            do {
+                output.push_back(byte + carry);
+                byte = 0xFF;
+            } while (--cache_size != 0);
+            cache = (low >> 24) & 0xFF;
+        }
+        cache_size++;
+        low = (low & 0x00FFFFFF) << 8;
+    }
+};
+
+class RangeDecoder {
+public:
+    RangeDecoder(const uint8_t* input, size_t input_size) : input(input), input_size(input_size), pos(0), code(0), range(0xFFFFFFFF) {
+        for (int i = 0; i < 5; i++) {
+            code = (code << 8) | next_byte();
+        }
+    }
+
+    int decode(uint16_t& prob) {
+        uint32_t bound = (range >> CM_PROB_BITS) * prob;
+        int bit;
+        if (code < bound) {
+            range = bound;
+            prob += ((1 << CM_PROB_BITS) - prob) >> CM_ADAPT_SHIFT;
+            bit = 0;
+        } else {
+            code -= bound;
+            range -= bound;
+            prob -= prob >> CM_ADAPT_SHIFT;
+            bit = 1;
+        }
+        while (range < CM_RANGE_TOP) {
+            range <<= 8;
+            code = (code << 8) | next_byte();
+        }
+        return bit;
+    }
+
+    // True if the decoder read past the end of the input
+    bool overrun() const {
+        return pos > input_size;
+    }
+
+private:
+    const uint8_t* input;
+    size_t input_size, pos;
+    uint32_t code, range;
+
+    uint8_t next_byte() {
+        return pos < input_size ? input[pos++] : (pos++, 0);
+    }
+};
+
+static int quantize_gradient(int d) {
+    if (d <= -CM_T3) return -4;
+    if (d <= -CM_T2) return -3;
+    if (d <= -CM_T1) return -2;
+    if (d < 0) return -1;
+    if (d == 0) return 0;
+    if (d < CM_T1) return 1;
+    if (d < CM_T2) return 2;
+    if (d < CM_T3) return 3;
+    return 4;
+}
+
+// Predict the pixel at (x, y) from the already coded pixels, missing
+// neighbours at the image border are replaced by the nearest known ones
+static PixelContext pixel_context(Model& model, const uint8_t* pixels, size_t width, size_t x, size_t y) {
+    const uint8_t* row = pixels + y * width;
+    const uint8_t* above = y > 0 ? row - width : row;
+    int w = x > 0 ? row[x - 1] : (y > 0 ? above[x] : 0);
+    int n = y > 0 ? above[x] : w;
+    int nw = y > 0 && x > 0 ? above[x - 1] : n;
+    int ne = y > 0 && x + 1 < width ? above[x + 1] : n;
+
+    int q1 = quantize_gradient(ne - n);
+    int q2 = quantize_gradient(n - nw);
+    int q3 = quantize_gradient(nw - w);
+    int sign = 1;
+    if (q1 < 0 || (q1 == 0 && (q2 < 0 || (q2 == 0 && q3 < 0)))) {
+        sign = -1;
+        q1 = -q1;
+        q2 = -q2;
+        q3 = -q3;
+    }
+    ContextStats* stats = &model.contexts[q1 * CM_GRADIENT_LEVELS * CM_GRADIENT_LEVELS + q2 * CM_GRADIENT_LEVELS + q3];
+
+    int prediction;
+    if (nw >= std::max(w, n)) {
+        prediction = std::min(w, n);
+    } else if (nw <= std::min(w, n)) {
+        prediction = std::max(w, n);
+    } else {
+        prediction = w + n - nw;
+    }
+    prediction = std::clamp(prediction + sign * stats->correction, 0, 255);
+
+    size_t activity = 0;
+    while (activity < CM_CLASSES - 1 && (stats->count << activity) < stats->magnitude_sum) {
+        activity++;
+    }
+    return PixelContext{stats, prediction, sign, activity};
+}
+
+// Update the statistics of a context with the coded residual
+// and adjust its bias correction
+static void update_context(ContextStats& stats, int error) {
+    stats.magnitude_sum += std::abs(error);
+    stats.bias_sum += error;
+    if (stats.count == CM_RESET) {
+        stats.magnitude_sum >>= 1;
+        stats.bias_sum >>= 1;
+        stats.count >>= 1;
+    }
+    stats.count++;
+
+    if (stats.bias_sum <= -stats.count) {
+        stats.bias_sum += stats.count;
+        stats.correction = std::max(stats.correction - 1, CM_MIN_CORRECTION);
+        stats.bias_sum = std::max(stats.bias_sum, -stats.count + 1);
+    } else if (stats.bias_sum > 0) {
+        stats.bias_sum -= stats.count;
+        stats.correction = std::min(stats.correction + 1, CM_MAX_CORRECTION);
+        stats.bias_sum = std::min(stats.bias_sum, 0);
+    }
+}
+
+size_t context_compress(const uint8_t* input, size_t width, size_t height, std::vector<uint8_t>& output) {
+    size_t start = output.size();
+    size_t pixel_count = width * height;
+    for (int shift = 0; shift < 32; shift += 8) {
+        output.push_back((pixel_count >> shift) & 0xFF);
+    }
+
+    std::unique_ptr<Model> model(new Model());
+    RangeEncoder encoder(output);
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            PixelContext context = pixel_context(*model, input, width, x, y);
+            int error = context.sign * (input[y * width + x] - context.prediction);
+            error = ((error + 128) & 0xFF) - 128;
+            update_context(*context.stats, error);
+
+            unsigned mapped = error >= 0 ? 2 * error : -2 * error - 1;
+            size_t bits = 0;
+            while ((mapped >> bits) != 0) {
+                bits++;
+            }
+            for (size_t k = 0; k < bits; k++) {
+                encoder.encode(model->magnitude[context.activity][k], 1);
+            }
+            if (bits < CM_MAGNITUDES - 1) {
+                encoder.encode(model->magnitude[context.activity][bits], 0);
+            }
+            for (size_t node = 1, k = bits - 1; bits >= 2 && k-- > 0;) {
+                int bit = (mapped >> k) & 1;
+                encoder.encode(model->mantissa[context.activity][bits][node], bit);
+                node = node * 2 + bit;
+            }
+        }
+    }
+    encoder.flush();
+
+    return output.size() - start;
+}
+
+size_t context_decompress(const uint8_t* input, size_t input_size, size_t width, std::vector<uint8_t>& output) {
+    if (input_size < CM_PIXEL_COUNT_SIZE || width == 0) {
+        return 0;
+    }
+    size_t pixel_count = input[0] | input[1] << 8 | input[2] << 16 | (size_t)input[3] << 24;
+    if (pixel_count % width != 0) {
+        return 0;
+    }
+    size_t height = pixel_count / width;
+
+    size_t start = output.size();
+    output.resize(start + pixel_count);
+    uint8_t* pixels = output.data() + start;
+
+    std::unique_ptr<Model> model(new Model());
+    RangeDecoder decoder(input + CM_PIXEL_COUNT_SIZE, input_size - CM_PIXEL_COUNT_SIZE);
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            PixelContext context = pixel_context(*model, pixels, width, x, y);
+
+            size_t bits = 0;
+            while (bits < CM_MAGNITUDES - 1 && decoder.decode(model->magnitude[context.activity][bits])) {
+                bits++;
+            }
+            unsigned mapped = bits > 0 ? 1 : 0;
+            for (size_t k = 1; k < bits; k++) {
+                mapped = mapped * 2 + decoder.decode(model->mantissa[context.activity][bits][mapped]);
+            }
+
+            int error = mapped & 1 ? -(int)(mapped + 1) / 2 : mapped / 2;
+            update_context(*context.stats, error);
+            pixels[y * width + x] = (context.prediction + context.sign * error) & 0xFF;
+        }
+    }
+
+    if (decoder.overrun()) {
+        output.resize(start);
+        return 0;
+    }
+    return pixel_count;
+}
@@ -0,0 +1,29 @@
+// context_model.hpp
+// Header file for the context modeling codec, which predicts every pixel from
+// its causal neighbours and codes the residuals with an adaptive binary
+// arithmetic coder, used instead of LZSS for the best compression ratio.
+
+#ifndef CONTEXT_MODEL_HPP
+#define CONTEXT_MODEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Compress an image with the context model
+// input: pointer to the pixels, stored row by row
+// width: width of the image
+// height: height of the image
+// output: vector the compressed data is appended to
+// Returns the size of the compressed data
+size_t context_compress(const uint8_t* input, size_t width, size_t height, std::vector<uint8_t>& output);
+
+// Decompress an image compressed by context_compress
+// input: pointer to the compressed data
+// input_size: size of the compressed data
+// width: width of the image
+// output: vector the pixels are appended to
+// Returns the number of decompressed pixels, 0 if the input is invalid
+size_t context_decompress(const uint8_t* input, size_t input_size, size_t width, std::vector<uint8_t>& output);
+
+#endif
@@ -0,0 +1,90 @@
+// dictionary.cpp
+// Source file for the preset dictionaries the LZSS window is preloaded with,
+// trained on a corpus of small, similar images.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <queue>
+#include <utility>
+#include <vector>
+#include "dictionary.hpp"
+
+// The corpus is cut into overlapping segments of DICT_SEGMENT_SIZE bytes
+// starting every DICT_SEGMENT_STEP bytes, a segment scores the corpus
+// frequencies of the DICT_KMER_SIZE byte substrings it contains
+// Segments are picked greedily by score, the substrings of a picked segment
+// no longer count, so the dictionary does not repeat itself
+#define DICT_SEGMENT_SIZE 64
+#define DICT_SEGMENT_STEP 16
+#define DICT_KMER_SIZE 6
+#define DICT_HASH_BITS 20
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+uint32_t dictionary_id(const std::vector<uint8_t>& dictionary) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (uint8_t byte : dictionary) {
+        hash = (hash ^ byte) * FNV_PRIME;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+// Hash of the substring at the given position
+static uint32_t kmer_hash(const uint8_t* data) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < DICT_KMER_SIZE; i++) {
+        value = value << 8 | data[i];
+    }
+    return (value * 0x9E3779B97F4A7C15ull) >> (64 - DICT_HASH_BITS);
+}
+
+void train_dictionary(const std::vector<uint8_t>& corpus, size_t dictionary_size, std::vector<uint8_t>& dictionary) {
+    dictionary.clear();
+    if (corpus.size() < DICT_SEGMENT_SIZE) {
+        dictionary.assign(corpus.end() - std::min(corpus.size(), dictionary_size), corpus.end());
+        return;
+    }
+
+    std::vector<uint32_t> hashes(corpus.size() - DICT_KMER_SIZE + 1);
+    std::vector<uint32_t> counts((size_t)1 << DICT_HASH_BITS, 0);
+    for (size_t i = 0; i < hashes.size(); i++) {
+        hashes[i] = kmer_hash(corpus.data() + i);
+        counts[hashes[i]]++;
+    }
+    auto score = [&](size_t pos) {
+        uint64_t sum = 0;
+        for (size_t i = pos; i + DICT_KMER_SIZE <= pos + DICT_SEGMENT_SIZE; i++) {
+            sum += counts[hashes[i]];
+        }
+        return sum;
+    };
+
+    // Scores only drop as segments are picked, so a segment whose rescored value
+    // still tops the queue is the best one without rescoring the others
+    std::priority_queue<std::pair<uint64_t, size_t>> queue;
+    for (size_t pos = 0; pos + DICT_SEGMENT_SIZE <= corpus.size(); pos += DICT_SEGMENT_STEP) {
+        queue.push({score(pos), pos});
+    }
+    std::vector<size_t> picked;
+    while (!queue.empty() && (picked.size() + 1) * DICT_SEGMENT_SIZE <= dictionary_size) {
+        auto [old_score, pos] = queue.top();
+        queue.pop();
+        uint64_t new_score = score(pos);
+        if (new_score == 0) {
+            continue;
+        } else if (new_score < old_score && !queue.empty() && new_score < queue.top().first) {
+            queue.push({new_score, pos});
+            continue;
+        }
+
+        picked.push_back(pos);
+        for (size_t i = pos; i + DICT_KMER_SIZE <= pos + DICT_SEGMENT_SIZE; i++) {
+            counts[hashes[i]] = 0;
+        }
+    }
+
+    for (size_t i = picked.size(); i-- > 0;) {
+        dictionary.insert(dictionary.end(), corpus.begin() + picked[i], corpus.begin() + picked[i] + DICT_SEGMENT_SIZE);
+    }
+}
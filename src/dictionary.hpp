@@ -0,0 +1,25 @@
+// dictionary.hpp
+// Header file for the preset dictionaries the LZSS window is preloaded with,
+// trained on a corpus of small, similar images.
+
+#ifndef DICTIONARY_HPP
+#define DICTIONARY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Identifier of a dictionary stored in the header, the FNV-1a hash of its
+// contents, never 0, which stands for no dictionary
+// dictionary: contents of the dictionary
+uint32_t dictionary_id(const std::vector<uint8_t>& dictionary);
+
+// Build a dictionary from the segments of the corpus that cover its most
+// frequent substrings
+// corpus: the sample data as the compressor sees it
+// dictionary_size: maximum size of the dictionary, usually the window size
+// dictionary: vector the dictionary is stored to, the most useful segments
+// come last so they get the shortest match offsets
+void train_dictionary(const std::vector<uint8_t>& corpus, size_t dictionary_size, std::vector<uint8_t>& dictionary);
+
+#endif
@@ -0,0 +1,218 @@
+// huffman.cpp
+// Source file for the canonical Huffman coder used as the entropy stage
+// on the LZSS streams.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+#include "bitstream.hpp"
+#include "huffman.hpp"
+
+// The coded stream starts with the code lengths of all symbols, four bits
+// each, a zero is followed by four more bits giving a run of 1-16 unused
+// symbols, the codes of the input bytes follow
+#define HUFFMAN_SYMBOLS 256
+#define HUFFMAN_LEN_BITS 4
+#define HUFFMAN_ZERO_RUN_MAX 16
+#define HUFFMAN_TABLE_SIZE (1 << HUFFMAN_MAX_CODE_LEN)
+
+// Entry of the decoding table, indexed by the next HUFFMAN_MAX_CODE_LEN bits
+// When the code of a second symbol fits the same bits, both are decoded at once
+struct DecodeEntry {
+    uint8_t symbols[2];
+    uint8_t first_len;
+    uint8_t total_len;
+    uint8_t count; // 0 if no code starts with the bits
+};
+
+// Build the Huffman code lengths of the symbol frequencies, when the code
+// gets longer than HUFFMAN_MAX_CODE_LEN the frequencies are halved and
+// the code is built again
+static void build_code_lengths(const size_t* freqs, uint8_t* lengths) {
+    std::vector<size_t> weights(freqs, freqs + HUFFMAN_SYMBOLS);
+    std::vector<uint16_t> leaves;
+    for (size_t s = 0; s < HUFFMAN_SYMBOLS; s++) {
+        lengths[s] = 0;
+        if (weights[s]) {
+            leaves.push_back(s);
+        }
+    }
+    if (leaves.size() == 1) {
+        lengths[leaves[0]] = 1;
+    }
+    if (leaves.size() <= 1) {
+        return;
+    }
+
+    while (true) {
+        // Nodes are numbered in order of creation, the leaves come first
+        // and every parent is created after its children
+        std::vector<size_t> parent(leaves.size());
+        std::priority_queue<std::pair<size_t, size_t>, std::vector<std::pair<size_t, size_t>>, std::greater<>> queue;
+        for (size_t i = 0; i < leaves.size(); i++) {
+            queue.push({weights[leaves[i]], i});
+        }
+        while (queue.size() > 1) {
+            auto a = queue.top();
+            queue.pop();
+            auto b = queue.top();
+            queue.pop();
+            parent[a.second] = parent[b.second] = parent.size();
+            parent.push_back(0);
+            queue.push({a.first + b.first, parent.size() - 1});
+        }
+
+        std::vector<uint8_t> depth(parent.size(), 0);
+        uint8_t max_len = 0;
+        for (size_t node = parent.size() - 1; node-- > 0;) {
+            depth[node] = depth[parent[node]] + 1;
+        }
+        for (size_t i = 0; i < leaves.size(); i++) {
+            lengths[leaves[i]] = depth[i];
+            max_len = std::max(max_len, depth[i]);
+        }
+        if (max_len <= HUFFMAN_MAX_CODE_LEN) {
+            return;
+        }
+
+        for (uint16_t s : leaves) {
+            weights[s] = (weights[s] + 1) / 2;
+        }
+    }
+}
+
+// Assign the canonical codes, shorter codes come first and codes of the same
+// length are ordered by symbol
+// Returns false if the lengths do not form a prefix code
+static bool build_codes(const uint8_t* lengths, uint16_t* codes) {
+    size_t length_count[HUFFMAN_MAX_CODE_LEN + 1] = {0};
+    size_t kraft = 0;
+    for (size_t s = 0; s < HUFFMAN_SYMBOLS; s++) {
+        if (lengths[s]) {
+            length_count[lengths[s]]++;
+            kraft += HUFFMAN_TABLE_SIZE >> lengths[s];
+        }
+    }
+    if (kraft > HUFFMAN_TABLE_SIZE) {
+        return false;
+    }
+
+    uint16_t next_code[HUFFMAN_MAX_CODE_LEN + 1] = {0};
+    uint16_t code = 0;
+    for (size_t len = 1; len <= HUFFMAN_MAX_CODE_LEN; len++) {
+        code = (code + length_count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+    for (size_t s = 0; s < HUFFMAN_SYMBOLS; s++) {
+        if (lengths[s]) {
+            codes[s] = next_code[lengths[s]]++;
+        }
+    }
+    return true;
+}
+
+void huffman_encode(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output) {
+    size_t freqs[HUFFMAN_SYMBOLS] = {0};
+    for (size_t i = 0; i < input_size; i++) {
+        freqs[input[i]]++;
+    }
+
+    uint8_t lengths[HUFFMAN_SYMBOLS];
+    uint16_t codes[HUFFMAN_SYMBOLS];
+    build_code_lengths(freqs, lengths);
+    build_codes(lengths, codes);
+
+    BitWriter writer(output);
+    for (size_t s = 0; s < HUFFMAN_SYMBOLS;) {
+        if (lengths[s]) {
+            writer.put(lengths[s], HUFFMAN_LEN_BITS);
+            s++;
+            continue;
+        }
+        size_t run = 1;
+        while (s + run < HUFFMAN_SYMBOLS && run < HUFFMAN_ZERO_RUN_MAX && lengths[s + run] == 0) {
+            run++;
+        }
+        writer.put(0, HUFFMAN_LEN_BITS);
+        writer.put(run - 1, HUFFMAN_LEN_BITS);
+        s += run;
+    }
+
+    for (size_t i = 0; i < input_size; i++) {
+        writer.put(codes[input[i]], lengths[input[i]]);
+    }
+    writer.flush();
+}
+
+bool huffman_decode(const uint8_t* input, size_t input_size, uint8_t* output, size_t count) {
+    BitReader reader(input, input_size);
+    uint8_t lengths[HUFFMAN_SYMBOLS];
+    uint16_t codes[HUFFMAN_SYMBOLS];
+    for (size_t s = 0; s < HUFFMAN_SYMBOLS;) {
+        uint8_t len = reader.get(HUFFMAN_LEN_BITS);
+        if (len > HUFFMAN_MAX_CODE_LEN) {
+            return false;
+        } else if (len) {
+            lengths[s++] = len;
+            continue;
+        }
+        size_t run = reader.get(HUFFMAN_LEN_BITS) + 1;
+        if (s + run > HUFFMAN_SYMBOLS) {
+            return false;
+        }
+        std::fill(lengths + s, lengths + s + run, 0);
+        s += run;
+    }
+    if (!build_codes(lengths, codes)) {
+        return false;
+    }
+
+    // Fill the entries of every code, then pair up the entries whose
+    // remaining bits hold the whole code of another symbol
+    std::vector<DecodeEntry> table(HUFFMAN_TABLE_SIZE, DecodeEntry{{0, 0}, 0, 0, 0});
+    for (size_t s = 0; s < HUFFMAN_SYMBOLS; s++) {
+        if (lengths[s]) {
+            size_t shift = HUFFMAN_MAX_CODE_LEN - lengths[s];
+            for (size_t index = (size_t)codes[s] << shift; index < (size_t)(codes[s] + 1) << shift; index++) {
+                table[index] = DecodeEntry{{(uint8_t)s, 0}, lengths[s], lengths[s], 1};
+            }
+        }
+    }
+    for (size_t index = 0; index < HUFFMAN_TABLE_SIZE; index++) {
+        DecodeEntry& entry = table[index];
+        if (entry.count == 0) {
+            continue;
+        }
+        const DecodeEntry& next = table[(index << entry.first_len) & (HUFFMAN_TABLE_SIZE - 1)];
+        if (next.count && entry.first_len + next.first_len <= HUFFMAN_MAX_CODE_LEN) {
+            entry.symbols[1] = next.symbols[0];
+            entry.total_len = entry.first_len + next.first_len;
+            entry.count = 2;
+        }
+    }
+
+    // A refill leaves at least 57 bits, enough for four lookups
+    size_t i = 0;
+    while (i < count) {
+        reader.refill();
+        for (int k = 0; k < 4 && i < count; k++) {
+            const DecodeEntry& entry = table[reader.peek(HUFFMAN_MAX_CODE_LEN)];
+            if (entry.count == 0) {
+                return false;
+            }
+            output[i++] = entry.symbols[0];
+            if (entry.count == 2 && i < count) {
+                output[i++] = entry.symbols[1];
+                reader.consume(entry.total_len);
+            } else {
+                reader.consume(entry.first_len);
+            }
+        }
+    }
+
+    return !reader.overrun();
+}
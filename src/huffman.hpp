@@ -0,0 +1,28 @@
+// huffman.hpp
+// Header file for the canonical Huffman coder used as the entropy stage
+// on the LZSS streams.
+
+#ifndef HUFFMAN_HPP
+#define HUFFMAN_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Longest code the coder produces, every code fits a single decoding table lookup
+#define HUFFMAN_MAX_CODE_LEN 11
+
+// Compress a byte stream with a canonical Huffman code built for it
+// input: pointer to the input data
+// input_size: size of the input data
+// output: vector the code lengths and the coded bits are appended to
+void huffman_encode(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output);
+
+// Decompress a byte stream compressed by huffman_encode
+// input: pointer to the compressed data
+// input_size: size of the compressed data
+// output: buffer for count decoded bytes
+// Returns false if the input is invalid
+bool huffman_decode(const uint8_t* input, size_t input_size, uint8_t* output, size_t count);
+
+#endif
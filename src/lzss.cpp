@@ -2,20 +2,113 @@
 // Author: Martin Zmitko (xzmitk01), created on 2025-05-12
 // Source file for the LZSS compression algorithm.
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <vector>
+#include "bitstream.hpp"
+#include "huffman.hpp"
 #include "lzss_buffer.hpp"
 #include "lzss.hpp"
+#include "rans.hpp"
 
-size_t lzss_compress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output) {
+// Variable-length tag classes, selected by the value of the first byte:
+// 0x00-0x3F  00oooo ll                     short, offset 1-16, length 2-5
+// 0x40-0xBF  (first - 0x40) xxxxxxxx       mid, 15-bit offset/length payload
+// 0xC0-0xDF  110xxxxx xxxxxxxx xxxxxxxx    long, 21-bit offset/length payload,
+//                                          a length field of all ones is followed
+//                                          by a byte extending the length
+// 0xE0-0xE7  11100vvv llllllll             2D, vector v from VARLEN_2D_VECTORS, length 2-257
+// 0xE8-0xF3  (first - 0xE8) = 4 * r + l     rep, offset from rep cache slot r, length 2-4
+//                                          for l = 0-2, l = 3 is followed by a length byte
+// 0xF4-0xFF  (first - 0xF4) = l           literal run, length 10-20 for l = 0-10, l = 11
+//                                          is followed by a 2-byte length, the literals
+//                                          themselves follow the tag
+// Offsets in the mid and long payloads only take as many bits as needed
+// to address the filled part of the window, the rest is used for the length
+// 2D tags address the data relative to the current position in an image
+// with the row stride given in the options, regardless of the window size
+// The rep cache holds the offsets of the last three matches of any class,
+// most recent first, a rep tag moves its offset to the front
+#define VARLEN_CLASS_SHORT 0x00
+#define VARLEN_CLASS_MID 0x40
+#define VARLEN_CLASS_LONG 0xC0
+#define VARLEN_CLASS_2D 0xE0
+#define VARLEN_CLASS_REP 0xE8
+#define VARLEN_CLASS_LITERAL_RUN 0xF4
+#define VARLEN_SHORT_MAX_OFFSET 16
+#define VARLEN_SHORT_MIN_LEN 2
+#define VARLEN_SHORT_MAX_LEN 5
+#define VARLEN_MID_PAYLOAD_BITS 15
+#define VARLEN_MID_MAX_OFFSET_BITS 11
+#define VARLEN_LONG_PAYLOAD_BITS 21
+#define VARLEN_LOOKAHEAD_SIZE 258
+#define VARLEN_2D_MIN_LEN 2
+#define VARLEN_2D_MAX_LEN (VARLEN_2D_MIN_LEN + 0xFF)
+#define VARLEN_REP_COUNT 3
+#define VARLEN_REP_MIN_LEN 2
+#define VARLEN_REP_SHORT_LENS 3
+#define VARLEN_REP_MAX_LEN (VARLEN_REP_MIN_LEN + VARLEN_REP_SHORT_LENS + 0xFF)
+#define VARLEN_LITERAL_RUN_MIN 10
+#define VARLEN_LITERAL_RUN_SHORT_LENS 11
+#define VARLEN_LITERAL_RUN_MAX (VARLEN_LITERAL_RUN_MIN + VARLEN_LITERAL_RUN_SHORT_LENS + 0xFFFF)
+
+// SoA blocks start with the varints of the token count and of the sizes
+// of the literal, length and offset streams, followed by the streams:
+// flags     one bit per token, 1 for a match, LSB first
+// literals  one byte per literal
+// lengths   one byte per match, length - 2
+// offsets   distance - 1 of each match, packed MSB first in as many bits as needed
+//           to address the filled part of the window at the match
+// With an entropy coder the block starts with the varints of the token,
+// literal and match counts instead, the offsets become codes that are 0-2
+// for a rep cache slot and distance + 2 otherwise, followed by:
+// flags         one bit per token as above
+// literals      coded stream of the literals
+// lengths       coded stream of the lengths
+// buckets       coded stream of the offset code buckets
+// extra bits    varint of the size and the extra bits of the buckets, MSB first
+// A coded stream is the coder used (SOA_STREAM_RAW when coding does not pay off)
+// and the varint of the coded size followed by the data
+// Offset codes below SOA_DIRECT_BUCKETS are buckets of their own, a larger code
+// with the highest bit n falls into bucket 2n or 2n + 1 by the bit below it,
+// the remaining n - 1 bits are the extra bits
+#define SOA_MIN_LEN 2
+#define SOA_MAX_LEN (SOA_MIN_LEN + 0xFF)
+#define SOA_STREAM_RAW 0
+#define SOA_DIRECT_BUCKETS 4
+
+// (dx, dy) of the 2D tag vectors relative to the current position,
+// the offset of a vector is dy * stride - dx
+static const int VARLEN_2D_VECTORS[8][2] = {
+    {0, 1}, {-1, 1}, {1, 1}, {-2, 1}, {2, 1}, {0, 2}, {-1, 2}, {1, 2}
+};
+
+// Number of bits needed to store any offset within the filled part of the window
+static unsigned offset_bits(size_t fill) {
+    unsigned bits = 1;
+    while (((size_t)1 << bits) < fill) {
+        bits++;
+    }
+    return bits;
+}
+
+// Savings in bits of encoding len bytes as a tag of tag_size bytes
+// instead of as literals, every token also costs one flag bit
+static long tag_savings(size_t len, size_t tag_size) {
+    return (long)(len * 9) - (long)(tag_size * 8 + 1);
+}
+
+static size_t compress_classic(const uint8_t* input, size_t input_size, size_t start, std::vector<uint8_t>& output,
+                               size_t window_size) {
     uint8_t flags_index = 0, flags_byte = 0;
     size_t wrote = 0;
     std::vector<uint8_t> tag_buffer;
 
-    SearchBuffer search_buffer(input, input_size);
+    SearchBuffer search_buffer(input, input_size, LOOKAHEAD_SIZE, window_size);
+    search_buffer.slide(start);
 
-    for (size_t i = 0; i < input_size; i++) {
+    for (size_t i = start; i < input_size; i++) {
         size_t match_len = 0;
         size_t match_pos = search_buffer.find_best_match(i, &match_len);
         if (match_len >= MATCH_THRESHOLD) {
@@ -36,8 +129,8 @@ size_t lzss_compress(const uint8_t* input, size_t input_size, std::vector<uint8_
         // If we have 8 flags or reached the end of input, write the flags and tags
         if (flags_index == 8 || i == input_size - 1) {
             size_t to_write = tag_buffer.size() + 1;
-            if (wrote + to_write >= input_size) {
-                return input_size; // Output too large, compression failed
+            if (wrote + to_write >= input_size - start) {
+                return input_size - start; // Output too large, compression failed
             }
             
             output.push_back(flags_byte);
@@ -54,7 +147,487 @@ size_t lzss_compress(const uint8_t* input, size_t input_size, std::vector<uint8_
     return wrote;
 }
 
-size_t lzss_decompress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output) {
+// Match candidate of the varlen encoder
+struct VarlenMatch {
+    uint8_t tag_class = VARLEN_CLASS_SHORT;
+    size_t len = 0;
+    size_t distance = 0; // how far back the match starts
+    size_t index = 0; // vector index of 2D tags, cache index of rep tags
+    size_t tag_size = 0;
+    long savings = 0;
+};
+
+// Length of the match between pos and pos - distance, up to max_len bytes
+static size_t probe(const uint8_t* input, size_t input_size, size_t pos, size_t distance, size_t max_len) {
+    size_t len = 0;
+    while (len < max_len && pos + len < input_size && input[pos + len] == input[pos + len - distance]) {
+        len++;
+    }
+    return len;
+}
+
+// Keep the candidate saving more bits, the earlier one wins a tie
+static void consider(VarlenMatch& best, uint8_t tag_class, size_t len, size_t distance, size_t index, size_t tag_size) {
+    long savings = tag_savings(len, tag_size);
+    if (savings > best.savings) {
+        best.tag_class = tag_class;
+        best.len = len;
+        best.distance = distance;
+        best.index = index;
+        best.tag_size = tag_size;
+        best.savings = savings;
+    }
+}
+
+// Move the distance to the front of the rep cache
+static void update_reps(size_t* reps, size_t distance) {
+    size_t k = 0;
+    while (k < VARLEN_REP_COUNT - 1 && reps[k] != distance) {
+        k++;
+    }
+    for (; k > 0; k--) {
+        reps[k] = reps[k - 1];
+    }
+    reps[0] = distance;
+}
+
+static void write_varlen_tag(const VarlenMatch& match, unsigned long_offset_bits, std::vector<uint8_t>& tag_buffer) {
+    switch (match.tag_class) {
+    case VARLEN_CLASS_SHORT:
+        tag_buffer.push_back(VARLEN_CLASS_SHORT | (match.distance - 1) << 2 | (match.len - VARLEN_SHORT_MIN_LEN));
+        break;
+    case VARLEN_CLASS_MID: {
+        unsigned mid_offset_bits = std::min(long_offset_bits, (unsigned)VARLEN_MID_MAX_OFFSET_BITS);
+        uint16_t payload = (match.distance - 1) << (VARLEN_MID_PAYLOAD_BITS - mid_offset_bits) | (match.len - MATCH_THRESHOLD);
+        tag_buffer.push_back(VARLEN_CLASS_MID + (payload >> 8));
+        tag_buffer.push_back(payload & 0xFF);
+        break;
+    }
+    case VARLEN_CLASS_LONG: {
+        unsigned long_len_bits = VARLEN_LONG_PAYLOAD_BITS - long_offset_bits;
+        size_t long_len_max = ((size_t)1 << long_len_bits) - 1;
+        size_t len_field = std::min(match.len - MATCH_THRESHOLD, long_len_max);
+        uint32_t payload = (match.distance - 1) << long_len_bits | len_field;
+        tag_buffer.push_back(VARLEN_CLASS_LONG | payload >> 16);
+        tag_buffer.push_back((payload >> 8) & 0xFF);
+        tag_buffer.push_back(payload & 0xFF);
+        if (len_field == long_len_max) {
+            tag_buffer.push_back(match.len - MATCH_THRESHOLD - long_len_max);
+        }
+        break;
+    }
+    case VARLEN_CLASS_2D:
+        tag_buffer.push_back(VARLEN_CLASS_2D | match.index);
+        tag_buffer.push_back(match.len - VARLEN_2D_MIN_LEN);
+        break;
+    case VARLEN_CLASS_REP:
+        if (match.len < VARLEN_REP_MIN_LEN + VARLEN_REP_SHORT_LENS) {
+            tag_buffer.push_back(VARLEN_CLASS_REP + match.index * 4 + (match.len - VARLEN_REP_MIN_LEN));
+        } else {
+            tag_buffer.push_back(VARLEN_CLASS_REP + match.index * 4 + VARLEN_REP_SHORT_LENS);
+            tag_buffer.push_back(match.len - VARLEN_REP_MIN_LEN - VARLEN_REP_SHORT_LENS);
+        }
+        break;
+    }
+}
+
+static size_t compress_varlen(const uint8_t* input, size_t input_size, size_t start, std::vector<uint8_t>& output,
+                              const LzssOptions& options) {
+    size_t window_size = options.window_size;
+    uint8_t flags_index = 0, flags_byte = 0;
+    size_t wrote = 0, literal_start = start;
+    std::vector<uint8_t> tag_buffer;
+    size_t reps[VARLEN_REP_COUNT] = {1, 2, 3};
+
+    SearchBuffer search_buffer(input, input_size, VARLEN_LOOKAHEAD_SIZE, window_size);
+    search_buffer.slide(start);
+
+    // Write the flags and tags collected so far
+    // Returns false if the output got too large and compression failed
+    auto flush_group = [&]() {
+        if (flags_index == 0) {
+            return true;
+        }
+        size_t to_write = tag_buffer.size() + 1;
+        if (wrote + to_write >= input_size - start) {
+            return false;
+        }
+
+        output.push_back(flags_byte);
+        output.insert(output.end(), tag_buffer.begin(), tag_buffer.end());
+        tag_buffer.clear();
+        wrote += to_write;
+        flags_byte = 0;
+        flags_index = 0;
+        return true;
+    };
+
+    // Finish a token already in the tag buffer, flushing every 8 tokens
+    auto end_token = [&](bool is_tag) {
+        if (is_tag) {
+            flags_byte |= (1 << flags_index); // Flag == 1 for a tag
+        }
+        flags_index++;
+        return flags_index < 8 || flush_group();
+    };
+
+    // Literals are held back until the next match, when there are enough
+    // of them they are copied out as a single literal run instead
+    auto flush_literals = [&](size_t end) {
+        while (literal_start < end) {
+            size_t count = end - literal_start;
+            if (count < VARLEN_LITERAL_RUN_MIN) {
+                tag_buffer.push_back(input[literal_start++]);
+                if (!end_token(false)) {
+                    return false;
+                }
+                continue;
+            }
+
+            size_t run = std::min(count, (size_t)VARLEN_LITERAL_RUN_MAX);
+            if (run < VARLEN_LITERAL_RUN_MIN + VARLEN_LITERAL_RUN_SHORT_LENS) {
+                tag_buffer.push_back(VARLEN_CLASS_LITERAL_RUN + (run - VARLEN_LITERAL_RUN_MIN));
+            } else {
+                size_t extra = run - VARLEN_LITERAL_RUN_MIN - VARLEN_LITERAL_RUN_SHORT_LENS;
+                tag_buffer.push_back(VARLEN_CLASS_LITERAL_RUN + VARLEN_LITERAL_RUN_SHORT_LENS);
+                tag_buffer.push_back(extra & 0xFF);
+                tag_buffer.push_back(extra >> 8);
+            }
+            tag_buffer.insert(tag_buffer.end(), input + literal_start, input + literal_start + run);
+            literal_start += run;
+            if (!end_token(true)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    for (size_t i = start; i < input_size; i++) {
+        size_t fill = std::min(i, window_size);
+        unsigned long_offset_bits = offset_bits(fill);
+        unsigned mid_offset_bits = std::min(long_offset_bits, (unsigned)VARLEN_MID_MAX_OFFSET_BITS);
+        VarlenMatch best;
+
+        // Recently used offsets are checked first, they are the cheapest to encode
+        for (size_t k = 0; k < VARLEN_REP_COUNT; k++) {
+            if (reps[k] <= i) {
+                size_t len = probe(input, input_size, i, reps[k], VARLEN_REP_MAX_LEN);
+                if (len >= VARLEN_REP_MIN_LEN) {
+                    consider(best, VARLEN_CLASS_REP, len, reps[k], k, len < VARLEN_REP_MIN_LEN + VARLEN_REP_SHORT_LENS ? 1 : 2);
+                }
+            }
+        }
+
+        // The tree only reports the longest match, probe the closest
+        // positions directly for matches that fit the 1-byte tag
+        for (size_t distance = 1; distance <= std::min(fill, (size_t)VARLEN_SHORT_MAX_OFFSET); distance++) {
+            size_t len = probe(input, input_size, i, distance, VARLEN_SHORT_MAX_LEN);
+            if (len >= VARLEN_SHORT_MIN_LEN) {
+                consider(best, VARLEN_CLASS_SHORT, len, distance, 0, 1);
+            }
+        }
+
+        // Row-to-row candidates are probed directly as well
+        for (size_t v = 0; options.stride && v < 8; v++) {
+            size_t distance = VARLEN_2D_VECTORS[v][1] * options.stride - VARLEN_2D_VECTORS[v][0];
+            if (distance <= i) {
+                size_t len = probe(input, input_size, i, distance, VARLEN_2D_MAX_LEN);
+                if (len >= VARLEN_2D_MIN_LEN) {
+                    consider(best, VARLEN_CLASS_2D, len, distance, v, 2);
+                }
+            }
+        }
+
+        // When one of the direct probes is good enough there is no need to search the tree
+        if (best.len < LOOKAHEAD_SIZE) {
+            size_t match_len = 0;
+            size_t match_pos = search_buffer.find_best_match(i, &match_len);
+            if (match_len >= MATCH_THRESHOLD) {
+                size_t distance = i - match_pos;
+                unsigned mid_len_bits = VARLEN_MID_PAYLOAD_BITS - mid_offset_bits;
+                if (distance - 1 < ((size_t)1 << mid_offset_bits) && match_len - MATCH_THRESHOLD < ((size_t)1 << mid_len_bits)) {
+                    consider(best, VARLEN_CLASS_MID, match_len, distance, 0, 2);
+                } else {
+                    size_t long_len_max = ((size_t)1 << (VARLEN_LONG_PAYLOAD_BITS - long_offset_bits)) - 1;
+                    match_len = std::min(match_len, MATCH_THRESHOLD + long_len_max + 0xFF);
+                    consider(best, VARLEN_CLASS_LONG, match_len, distance, 0, match_len - MATCH_THRESHOLD >= long_len_max ? 4 : 3);
+                }
+            }
+        }
+
+        if (best.savings > 0) {
+            if (!flush_literals(i)) {
+                return input_size - start;
+            }
+            write_varlen_tag(best, long_offset_bits, tag_buffer);
+            update_reps(reps, best.distance);
+            if (!end_token(true)) {
+                return input_size - start;
+            }
+            i += best.len - 1;
+            literal_start = i + 1;
+            search_buffer.slide(best.len);
+        } else {
+            search_buffer.slide(1);
+        }
+    }
+
+    if (!flush_literals(input_size) || !flush_group()) {
+        return input_size - start;
+    }
+
+    return wrote;
+}
+
+// Offset code of the SoA offsets stream, the rep cache slots come first
+static size_t soa_offset_code(const size_t* reps, size_t distance) {
+    for (size_t k = 0; k < VARLEN_REP_COUNT; k++) {
+        if (reps[k] == distance) {
+            return k;
+        }
+    }
+    return distance + VARLEN_REP_COUNT - 1;
+}
+
+static size_t varint_size(size_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// Write a value as a little-endian base 128 varint
+static void put_varint(std::vector<uint8_t>& output, size_t value) {
+    while (value >= 0x80) {
+        output.push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    output.push_back(value);
+}
+
+// Read a varint at pos, advancing pos past it
+// Returns false if the varint runs past the end of the input
+static bool get_varint(const uint8_t* input, size_t input_size, size_t& pos, size_t& value) {
+    value = 0;
+    for (unsigned shift = 0; pos < input_size && shift < 64; shift += 7) {
+        uint8_t byte = input[pos++];
+        value |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Split an offset code into its bucket and the number of extra bits
+static uint8_t offset_bucket(size_t code, unsigned& extra_bits) {
+    if (code < SOA_DIRECT_BUCKETS) {
+        extra_bits = 0;
+        return code;
+    }
+    unsigned high_bit = 0;
+    while (code >> (high_bit + 1)) {
+        high_bit++;
+    }
+    extra_bits = high_bit - 1;
+    return 2 * high_bit + ((code >> extra_bits) & 1);
+}
+
+// Write a stream with the entropy coder, or raw if coding does not make it smaller
+static void put_coded_stream(uint8_t entropy, const std::vector<uint8_t>& stream, std::vector<uint8_t>& output) {
+    std::vector<uint8_t> coded;
+    if (entropy == LZSS_ENTROPY_HUFFMAN && !stream.empty()) {
+        huffman_encode(stream.data(), stream.size(), coded);
+    } else if (entropy == LZSS_ENTROPY_RANS && !stream.empty()) {
+        rans_encode(stream.data(), stream.size(), coded);
+    }
+    if (coded.empty() || coded.size() >= stream.size()) {
+        output.push_back(SOA_STREAM_RAW);
+        put_varint(output, stream.size());
+        output.insert(output.end(), stream.begin(), stream.end());
+    } else {
+        output.push_back(entropy);
+        put_varint(output, coded.size());
+        output.insert(output.end(), coded.begin(), coded.end());
+    }
+}
+
+// Read count bytes of a stream written by put_coded_stream at pos, advancing pos past it
+// Returns false if the stream is invalid
+static bool get_coded_stream(const uint8_t* input, size_t input_size, size_t& pos, size_t count, std::vector<uint8_t>& stream) {
+    size_t size;
+    if (pos >= input_size) {
+        return false;
+    }
+    uint8_t coder = input[pos++];
+    if (!get_varint(input, input_size, pos, size) || size > input_size - pos) {
+        return false;
+    }
+
+    stream.resize(count);
+    const uint8_t* data = input + pos;
+    pos += size;
+    if (coder == SOA_STREAM_RAW) {
+        if (size != count) {
+            return false;
+        }
+        std::copy(data, data + size, stream.begin());
+        return true;
+    } else if (coder == LZSS_ENTROPY_HUFFMAN) {
+        return huffman_decode(data, size, stream.data(), count);
+    } else if (coder == LZSS_ENTROPY_RANS) {
+        return rans_decode(data, size, stream.data(), count);
+    }
+    return false;
+}
+
+static size_t compress_soa(const uint8_t* input, size_t input_size, size_t start, std::vector<uint8_t>& output,
+                           const LzssOptions& options) {
+    size_t window_size = options.window_size;
+    size_t token_count = 0, offset_bits_total = 0;
+    std::vector<uint8_t> flags, literals, lengths;
+    std::vector<size_t> offset_codes;
+    std::vector<unsigned> offset_widths;
+    size_t reps[VARLEN_REP_COUNT] = {1, 2, 3};
+
+    SearchBuffer search_buffer(input, input_size, SOA_MAX_LEN, window_size);
+    search_buffer.slide(start);
+
+    for (size_t i = start; i < input_size; i++) {
+        size_t fill = std::min(i, window_size);
+        VarlenMatch best;
+
+        // Same candidates as the varlen encoder, but a match always costs
+        // a length byte and its offset, packed at a fixed width when
+        // uncoded and estimated by the varint of its code otherwise
+        unsigned offset_width = offset_bits(fill);
+        auto consider_distance = [&](uint8_t tag_class, size_t len, size_t distance) {
+            size_t offset_size = options.entropy == LZSS_ENTROPY_NONE
+                ? offset_width : 8 * varint_size(soa_offset_code(reps, distance));
+            long savings = (long)(len * 9) - (long)(8 + offset_size + 1);
+            if (len >= SOA_MIN_LEN && savings > best.savings) {
+                best.tag_class = tag_class;
+                best.len = len;
+                best.distance = distance;
+                best.savings = savings;
+            }
+        };
+        for (size_t k = 0; k < VARLEN_REP_COUNT; k++) {
+            if (reps[k] <= i) {
+                consider_distance(VARLEN_CLASS_REP, probe(input, input_size, i, reps[k], SOA_MAX_LEN), reps[k]);
+            }
+        }
+        for (size_t distance = 1; distance <= std::min(fill, (size_t)VARLEN_SHORT_MAX_OFFSET); distance++) {
+            consider_distance(VARLEN_CLASS_SHORT, probe(input, input_size, i, distance, VARLEN_SHORT_MAX_LEN), distance);
+        }
+        // Uncoded offsets are only wide enough for the window
+        size_t reach = options.entropy == LZSS_ENTROPY_NONE ? fill : i;
+        for (size_t v = 0; options.stride && v < 8; v++) {
+            size_t distance = VARLEN_2D_VECTORS[v][1] * options.stride - VARLEN_2D_VECTORS[v][0];
+            if (distance <= reach) {
+                consider_distance(VARLEN_CLASS_2D, probe(input, input_size, i, distance, SOA_MAX_LEN), distance);
+            }
+        }
+        if (best.len < LOOKAHEAD_SIZE) {
+            size_t match_len = 0;
+            size_t match_pos = search_buffer.find_best_match(i, &match_len);
+            if (match_len >= MATCH_THRESHOLD) {
+                consider_distance(VARLEN_CLASS_MID, match_len, i - match_pos);
+            }
+        }
+
+        if (token_count % 8 == 0) {
+            flags.push_back(0);
+        }
+        if (best.savings > 0) {
+            flags.back() |= 1 << (token_count % 8);
+            lengths.push_back(best.len - SOA_MIN_LEN);
+            offset_codes.push_back(options.entropy == LZSS_ENTROPY_NONE ? best.distance - 1 : soa_offset_code(reps, best.distance));
+            offset_widths.push_back(offset_width);
+            offset_bits_total += offset_width;
+            update_reps(reps, best.distance);
+            i += best.len - 1;
+            search_buffer.slide(best.len);
+        } else {
+            literals.push_back(input[i]);
+            search_buffer.slide(1);
+        }
+        token_count++;
+
+        // The size of the coded streams is only known at the end
+        if (options.entropy == LZSS_ENTROPY_NONE && flags.size() + literals.size() + lengths.size() + offset_bits_total / 8 >= input_size - start) {
+            return input_size - start; // Output too large, compression failed
+        }
+    }
+
+    size_t output_start = output.size();
+    if (options.entropy == LZSS_ENTROPY_NONE) {
+        std::vector<uint8_t> offsets;
+        BitWriter offsets_writer(offsets);
+        for (size_t k = 0; k < offset_codes.size(); k++) {
+            offsets_writer.put(offset_codes[k], offset_widths[k]);
+        }
+        offsets_writer.flush();
+
+        put_varint(output, token_count);
+        put_varint(output, literals.size());
+        put_varint(output, lengths.size());
+        put_varint(output, offsets.size());
+        output.insert(output.end(), flags.begin(), flags.end());
+        output.insert(output.end(), literals.begin(), literals.end());
+        output.insert(output.end(), lengths.begin(), lengths.end());
+        output.insert(output.end(), offsets.begin(), offsets.end());
+    } else {
+        std::vector<uint8_t> buckets, extra;
+        BitWriter extra_writer(extra);
+        for (size_t code : offset_codes) {
+            unsigned extra_bits;
+            buckets.push_back(offset_bucket(code, extra_bits));
+            extra_writer.put(code & (((size_t)1 << extra_bits) - 1), extra_bits);
+        }
+        extra_writer.flush();
+
+        put_varint(output, token_count);
+        put_varint(output, literals.size());
+        put_varint(output, lengths.size());
+        output.insert(output.end(), flags.begin(), flags.end());
+        put_coded_stream(options.entropy, literals, output);
+        put_coded_stream(options.entropy, lengths, output);
+        put_coded_stream(options.entropy, buckets, output);
+        put_varint(output, extra.size());
+        output.insert(output.end(), extra.begin(), extra.end());
+    }
+
+    if (output.size() - output_start >= input_size - start) {
+        output.resize(output_start);
+        return input_size - start;
+    }
+    return output.size() - output_start;
+}
+
+size_t lzss_compress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output, const LzssOptions& options) {
+    // The history is put in front of the input and only searched, coding starts after it
+    std::vector<uint8_t> primed;
+    size_t start = 0;
+    if (options.history_size > 0) {
+        primed.assign(options.history, options.history + options.history_size);
+        primed.insert(primed.end(), input, input + input_size);
+        input = primed.data();
+        start = options.history_size;
+        input_size += start;
+    }
+
+    if (options.format == LZSS_FORMAT_VARLEN) {
+        return compress_varlen(input, input_size, start, output, options);
+    } else if (options.format == LZSS_FORMAT_SOA) {
+        return compress_soa(input, input_size, start, output, options);
+    }
+    return compress_classic(input, input_size, start, output, options.window_size);
+}
+
+static size_t decompress_classic(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output) {
     size_t input_pos = 0, wrote = 0;
 
     while (input_pos < input_size) {
@@ -80,3 +653,221 @@ size_t lzss_decompress(const uint8_t* input, size_t input_size, std::vector<uint
 
     return wrote;
 }
+
+static size_t decompress_varlen(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output, const LzssOptions& options) {
+    size_t window_size = options.window_size;
+    size_t input_pos = 0, wrote = 0;
+    size_t reps[VARLEN_REP_COUNT] = {1, 2, 3};
+
+    while (input_pos < input_size) {
+        uint8_t flags_byte = input[input_pos++];
+        for (int i = 0; i < 8 && input_pos < input_size; i++) {
+            if (!(flags_byte & (1 << i))) {
+                output.push_back(input[input_pos++]);
+                wrote++;
+                continue;
+            }
+
+            size_t fill = std::min(options.history_size + wrote, window_size);
+            uint8_t tag = input[input_pos++];
+            size_t match_len, distance;
+            if (tag < VARLEN_CLASS_MID) {
+                distance = ((tag >> 2) & 0x0F) + 1;
+                match_len = (tag & 0x03) + VARLEN_SHORT_MIN_LEN;
+            } else if (tag < VARLEN_CLASS_LONG) {
+                unsigned len_bits = VARLEN_MID_PAYLOAD_BITS - std::min(offset_bits(fill), (unsigned)VARLEN_MID_MAX_OFFSET_BITS);
+                uint16_t payload = (tag - VARLEN_CLASS_MID) << 8 | input[input_pos];
+                input_pos += 1;
+                distance = (payload >> len_bits) + 1;
+                match_len = (payload & ((1 << len_bits) - 1)) + MATCH_THRESHOLD;
+            } else if (tag < VARLEN_CLASS_2D) {
+                unsigned len_bits = VARLEN_LONG_PAYLOAD_BITS - offset_bits(fill);
+                uint32_t payload = (tag & 0x1F) << 16 | input[input_pos] << 8 | input[input_pos + 1];
+                input_pos += 2;
+                distance = (payload >> len_bits) + 1;
+                match_len = payload & ((1 << len_bits) - 1);
+                if (match_len == (size_t)(1 << len_bits) - 1) {
+                    match_len += input[input_pos++];
+                }
+                match_len += MATCH_THRESHOLD;
+            } else if (tag < VARLEN_CLASS_REP && options.stride) {
+                const int* vector = VARLEN_2D_VECTORS[tag & 0x07];
+                distance = vector[1] * options.stride - vector[0];
+                match_len = input[input_pos++] + VARLEN_2D_MIN_LEN;
+            } else if (tag >= VARLEN_CLASS_LITERAL_RUN) {
+                size_t run = tag - VARLEN_CLASS_LITERAL_RUN + VARLEN_LITERAL_RUN_MIN;
+                if (tag - VARLEN_CLASS_LITERAL_RUN == VARLEN_LITERAL_RUN_SHORT_LENS) {
+                    run += input[input_pos] | input[input_pos + 1] << 8;
+                    input_pos += 2;
+                }
+                if (input_pos + run > input_size) {
+                    return wrote; // Run past the end of the input, the stream is invalid
+                }
+                output.insert(output.end(), input + input_pos, input + input_pos + run);
+                input_pos += run;
+                wrote += run;
+                continue;
+            } else if (tag >= VARLEN_CLASS_REP) {
+                distance = reps[(tag - VARLEN_CLASS_REP) / 4];
+                match_len = (tag - VARLEN_CLASS_REP) % 4 + VARLEN_REP_MIN_LEN;
+                if (match_len == VARLEN_REP_MIN_LEN + VARLEN_REP_SHORT_LENS) {
+                    match_len += input[input_pos++];
+                }
+            } else {
+                return wrote; // 2D tag without a stride, the stream is invalid
+            }
+            update_reps(reps, distance);
+
+            size_t match_pos = output.size() - distance;
+            for (size_t j = 0; j < match_len; j++) {
+                output.push_back(output[match_pos++]);
+            }
+            wrote += match_len;
+        }
+    }
+
+    return wrote;
+}
+
+// Decode the SoA tokens from the separate streams
+// next_offset: callable reading the next offset code of a match starting wrote bytes
+// into the stream, returns false at the end of the offsets
+template <typename NextOffset>
+static size_t decode_soa_tokens(const uint8_t* flags, size_t token_count, const uint8_t* literals, size_t literals_size,
+                                const uint8_t* lengths, size_t lengths_size, NextOffset next_offset, std::vector<uint8_t>& output) {
+    size_t literal_pos = 0, length_pos = 0, wrote = 0;
+    size_t reps[VARLEN_REP_COUNT] = {1, 2, 3};
+
+    for (size_t i = 0; i < token_count; i++) {
+        // A zero flags byte is eight literals in a row, copy them at once
+        if (i % 8 == 0 && i + 8 <= token_count && flags[i / 8] == 0 && literal_pos + 8 <= literals_size) {
+            output.insert(output.end(), literals + literal_pos, literals + literal_pos + 8);
+            literal_pos += 8;
+            wrote += 8;
+            i += 7;
+            continue;
+        }
+
+        if (!(flags[i / 8] & (1 << (i % 8)))) {
+            if (literal_pos >= literals_size) {
+                return wrote;
+            }
+            output.push_back(literals[literal_pos++]);
+            wrote++;
+            continue;
+        }
+
+        size_t code;
+        if (length_pos >= lengths_size || !next_offset(wrote, code)) {
+            return wrote;
+        }
+        size_t match_len = lengths[length_pos++] + SOA_MIN_LEN;
+        size_t distance = code < VARLEN_REP_COUNT ? reps[code] : code - (VARLEN_REP_COUNT - 1);
+        update_reps(reps, distance);
+
+        size_t match_pos = output.size() - distance;
+        for (size_t j = 0; j < match_len; j++) {
+            output.push_back(output[match_pos++]);
+        }
+        wrote += match_len;
+    }
+
+    return wrote;
+}
+
+static size_t decompress_soa(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output, const LzssOptions& options) {
+    size_t pos = 0, token_count, literals_size, lengths_size, offsets_size;
+    if (!get_varint(input, input_size, pos, token_count)
+        || !get_varint(input, input_size, pos, literals_size)
+        || !get_varint(input, input_size, pos, lengths_size)
+        || !get_varint(input, input_size, pos, offsets_size)
+    ) {
+        return 0;
+    }
+
+    size_t flags_size = (token_count + 7) / 8;
+    if (flags_size + literals_size + lengths_size + offsets_size > input_size - pos) {
+        return 0;
+    }
+    const uint8_t* flags = input + pos;
+    const uint8_t* literals = flags + flags_size;
+    const uint8_t* lengths = literals + literals_size;
+    BitReader offsets_reader(lengths + lengths_size, offsets_size);
+
+    // The offsets are distances, turned into the codes past the rep cache slots
+    return decode_soa_tokens(flags, token_count, literals, literals_size, lengths, lengths_size, [&](size_t wrote, size_t& code) {
+        unsigned width = offset_bits(std::min(options.history_size + wrote, options.window_size));
+        if (width > sizeof(uint32_t) * 8) {
+            return false;
+        }
+        code = offsets_reader.get(width) + VARLEN_REP_COUNT;
+        return !offsets_reader.overrun();
+    }, output);
+}
+
+static size_t decompress_soa_coded(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output) {
+    size_t pos = 0, token_count, literals_size, lengths_size, extra_size;
+    if (!get_varint(input, input_size, pos, token_count)
+        || !get_varint(input, input_size, pos, literals_size)
+        || !get_varint(input, input_size, pos, lengths_size)
+        || token_count / 8 >= input_size - pos
+    ) {
+        return 0;
+    }
+
+    const uint8_t* flags = input + pos;
+    pos += (token_count + 7) / 8;
+    std::vector<uint8_t> literals, lengths, buckets;
+    if (!get_coded_stream(input, input_size, pos, literals_size, literals)
+        || !get_coded_stream(input, input_size, pos, lengths_size, lengths)
+        || !get_coded_stream(input, input_size, pos, lengths_size, buckets)
+        || !get_varint(input, input_size, pos, extra_size)
+        || extra_size > input_size - pos
+    ) {
+        return 0;
+    }
+    BitReader extra_reader(input + pos, extra_size);
+    size_t bucket_pos = 0;
+
+    return decode_soa_tokens(flags, token_count, literals.data(), literals_size, lengths.data(), lengths_size, [&](size_t, size_t& code) {
+        if (bucket_pos >= buckets.size()) {
+            return false;
+        }
+        uint8_t bucket = buckets[bucket_pos++];
+        if (bucket < SOA_DIRECT_BUCKETS) {
+            code = bucket;
+            return true;
+        }
+        unsigned extra_bits = bucket / 2 - 1;
+        if (extra_bits >= sizeof(uint32_t) * 8) {
+            return false;
+        }
+        code = ((size_t)(2 | (bucket & 1)) << extra_bits) | extra_reader.get(extra_bits);
+        return !extra_reader.overrun();
+    }, output);
+}
+
+// Decode the stream in the given format, appending to output
+static size_t decompress_stream(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output, const LzssOptions& options) {
+    if (options.format == LZSS_FORMAT_VARLEN) {
+        return decompress_varlen(input, input_size, output, options);
+    } else if (options.format == LZSS_FORMAT_SOA) {
+        if (options.entropy != LZSS_ENTROPY_NONE) {
+            return decompress_soa_coded(input, input_size, output);
+        }
+        return decompress_soa(input, input_size, output, options);
+    }
+    return decompress_classic(input, input_size, output);
+}
+
+size_t lzss_decompress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output, const LzssOptions& options) {
+    if (options.history_size == 0) {
+        return decompress_stream(input, input_size, output, options);
+    }
+
+    // Matches can reach into the history when it is decoded right after it
+    std::vector<uint8_t> primed(options.history, options.history + options.history_size);
+    size_t wrote = decompress_stream(input, input_size, primed, options);
+    output.insert(output.end(), primed.begin() + options.history_size, primed.end());
+    return wrote;
+}
@@ -8,6 +8,39 @@
 #include <cstddef>
 #include <cstdint>
 #include <vector>
+#include "lzss_buffer.hpp"
+
+// Token formats of the compressed stream
+// CLASSIC: literal bytes and fixed 2-byte tags (11-bit offset, 5-bit length),
+// the window can not be larger than SLIDING_WINDOW_SIZE
+// VARLEN: literal bytes and 1, 2 or 3-byte tags, the tag class is given
+// by the value of the first tag byte
+// SOA: the flags, literals, match lengths and match offsets are stored
+// in four separate streams, each read with its own cursor
+#define LZSS_FORMAT_CLASSIC 0
+#define LZSS_FORMAT_VARLEN 1
+#define LZSS_FORMAT_SOA 2
+
+// Entropy coders of the SOA streams
+// NONE: the streams are stored as they are
+// HUFFMAN: literals, lengths and offset buckets use canonical Huffman
+// codes built for each compressed stream
+// RANS: the same streams use interleaved rANS with static frequencies
+// counted for each compressed stream
+#define LZSS_ENTROPY_NONE 0
+#define LZSS_ENTROPY_HUFFMAN 1
+#define LZSS_ENTROPY_RANS 2
+
+// Options shared by the compressor and decompressor, both sides
+// must use the same options for the stream to be decoded correctly
+struct LzssOptions {
+    uint8_t format = LZSS_FORMAT_CLASSIC;
+    size_t window_size = SLIDING_WINDOW_SIZE; // power of two, MIN_WINDOW_SIZE to MAX_WINDOW_SIZE
+    size_t stride = 0; // image row stride for 2D matches, 0 if the data is not an image
+    uint8_t entropy = LZSS_ENTROPY_NONE; // only used by the SOA format
+    const uint8_t* history = nullptr; // data preceding the input that matches can refer to
+    size_t history_size = 0; // at most window_size bytes, 0 for no history
+};
 
 // Compress the input data using LZSS algorithm
 // input: pointer to the input data
@@ -17,13 +50,17 @@
 // If the output size exceeds the input size, compression failed
 // and the function returns input_size, indicating no compression was done
 // and the output vector is invalid
-size_t lzss_compress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output);
+// options: token format and other stream parameters
+size_t lzss_compress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output,
+                     const LzssOptions& options = LzssOptions());
 
 // Decompress the input data using LZSS algorithm
 // input: pointer to the input data
 // input_size: size of the input data
 // output: vector to store the decompressed data
+// options: token format and other stream parameters
 // Returns the size of the decompressed data
-size_t lzss_decompress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output);
+size_t lzss_decompress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output,
+                       const LzssOptions& options = LzssOptions());
 
 #endif
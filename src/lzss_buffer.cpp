@@ -3,12 +3,15 @@
 // Source file for the SearchBuffer class, which implements a binary search
 // tree and manages a sliding window buffer keeping the tree updated.
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <vector>
 #include "lzss_buffer.hpp"
 
-SearchBuffer::SearchBuffer(const uint8_t* buffer, size_t buffer_size)
-    : buffer(buffer), buffer_size(buffer_size), window_pos(0), root(nullptr)
+SearchBuffer::SearchBuffer(const uint8_t* buffer, size_t buffer_size, size_t lookahead, size_t window_size)
+    : buffer(buffer), buffer_size(buffer_size), window_pos(0), lookahead(lookahead), window_size(window_size),
+      key_size(std::min(lookahead, (size_t)LOOKAHEAD_SIZE)), root(nullptr)
     {}
 
 void SearchBuffer::slide(size_t n) {
@@ -17,18 +20,42 @@ void SearchBuffer::slide(size_t n) {
             break;
         }
 
-        if (i >= SLIDING_WINDOW_SIZE) {
-            root = delete_node(root, i - SLIDING_WINDOW_SIZE);
+        if (i >= window_size) {
+            delete_node(i - window_size);
         }
 
-        root = insert_node(root, i);
+        insert_node(i);
     }
 
     window_pos += n;
 }
 
 size_t SearchBuffer::find_best_match(size_t pos, size_t* match_len) const {
-    return best_match_node(root, pos, match_len);
+    size_t best_pos = SIZE_MAX;
+    Node* node = root;
+
+    while (node) {
+        size_t len = common_prefix_len(pos, node->pos, key_size);
+        if (len == key_size) {
+            // Keys are unique and the node holds the closest position
+            // with this key, only extend the match past the key
+            len = common_prefix_len(pos, node->pos, lookahead);
+        }
+        if (len > *match_len) {
+            *match_len = len;
+            best_pos = node->pos;
+        }
+        if (len >= key_size) {
+            break;
+        }
+
+        // The common prefix already tells which way to go, no need to compare again
+        bool less = pos + len >= buffer_size
+            || (node->pos + len < buffer_size && buffer[pos + len] < buffer[node->pos + len]);
+        node = less ? node->left : node->right;
+    }
+
+    return best_pos;
 }
 
 SearchBuffer::~SearchBuffer() {
@@ -37,96 +64,83 @@ SearchBuffer::~SearchBuffer() {
 }
 
 void SearchBuffer::delete_tree(Node* node) {
-    if (!node)
-        return;
-
-    delete_tree(node->left);
-    delete_tree(node->right);
-    delete node;
+    // Iterative, the tree can be as deep as the window is large
+    std::vector<Node*> stack;
+    if (node) {
+        stack.push_back(node);
+    }
+    while (!stack.empty()) {
+        Node* top = stack.back();
+        stack.pop_back();
+        if (top->left) {
+            stack.push_back(top->left);
+        }
+        if (top->right) {
+            stack.push_back(top->right);
+        }
+        delete top;
+    }
 }
 
-SearchBuffer::Node* SearchBuffer::insert_node(Node* node, size_t pos) {
-    if (!node)
-        return new Node(pos);
-
-    if (compare(pos, node->pos) < 0) {
-        node->left = insert_node(node->left, pos);
-    } else {
-        node->right = insert_node(node->right, pos);
+void SearchBuffer::insert_node(size_t pos) {
+    Node** link = &root;
+    while (*link) {
+        Node* node = *link;
+        int16_t cmp = compare(pos, node->pos);
+        if (cmp == 0) {
+            node->pos = pos;
+            return;
+        }
+        link = cmp < 0 ? &node->left : &node->right;
     }
 
-    return node;
+    *link = new Node(pos);
 }
 
-SearchBuffer::Node* SearchBuffer::delete_node(Node* node, size_t pos) {
-    if (!node)
-        return nullptr;
-
-    int16_t cmp = compare(pos, node->pos);
-    if (cmp < 0) {
-        node->left = delete_node(node->left, pos);
-    } else if (cmp > 0) {
-        node->right = delete_node(node->right, pos);
-    } else {
-        if (!node->left) {
-            Node* right = node->right;
-            delete node;
-            return right;
-        } else if (!node->right) {
-            Node* left = node->left;
-            delete node;
-            return left;
+void SearchBuffer::delete_node(size_t pos) {
+    Node** link = &root;
+    while (*link) {
+        Node* node = *link;
+        int16_t cmp = compare(pos, node->pos);
+        if (cmp < 0) {
+            link = &node->left;
+        } else if (cmp > 0) {
+            link = &node->right;
+        } else if (node->pos != pos) {
+            return; // Replaced by a newer position with the same key
         } else {
-            Node* succ_parent = node;
-            Node* succ = node->right;
-            while (succ->left) {
-                succ_parent = succ;
-                succ = succ->left;
-            }
-            node->pos = succ->pos;
-            if (succ_parent->left == succ) {
-                succ_parent->left = succ->right;
+            if (!node->left) {
+                *link = node->right;
+                delete node;
+            } else if (!node->right) {
+                *link = node->left;
+                delete node;
             } else {
-                succ_parent->right = succ->right;
+                Node* succ_parent = node;
+                Node* succ = node->right;
+                while (succ->left) {
+                    succ_parent = succ;
+                    succ = succ->left;
+                }
+                node->pos = succ->pos;
+                if (succ_parent->left == succ) {
+                    succ_parent->left = succ->right;
+                } else {
+                    succ_parent->right = succ->right;
+                }
+                delete succ;
             }
-            delete succ;
+            return;
         }
     }
-
-    return node;
-}
-
-size_t SearchBuffer::best_match_node(Node* node, size_t pos, size_t* best_len) const {
-    if (!node)
-        return SIZE_MAX;
-
-    size_t match_len = common_prefix_len(pos, node->pos);
-    size_t best_pos = SIZE_MAX;
-
-    if (match_len > *best_len) {
-        *best_len = match_len;
-        best_pos = node->pos;
-    }
-
-    if (compare(pos, node->pos) < 0) {
-        size_t left = best_match_node(node->left, pos, best_len);
-        if (left != SIZE_MAX) {
-            best_pos = left;
-        }
-    } else {
-        size_t right = best_match_node(node->right, pos, best_len);
-        if (right != SIZE_MAX) {
-            best_pos = right;
-        }
-    }
-
-    return best_pos;
 }
 
 int16_t SearchBuffer::compare(size_t pos_a, size_t pos_b) const {
-    for (size_t i = 0; i < LOOKAHEAD_SIZE; i++) {
-        if (pos_a + i >= buffer_size || pos_b + i >= buffer_size) {
-            break;
+    for (size_t i = 0; i < key_size; i++) {
+        bool end_a = pos_a + i >= buffer_size;
+        bool end_b = pos_b + i >= buffer_size;
+        if (end_a || end_b) {
+            return end_b - end_a;
         } else if (buffer[pos_a + i] != buffer[pos_b + i]) {
             return buffer[pos_a + i] - buffer[pos_b + i];
         }
@@ -135,8 +149,8 @@ int16_t SearchBuffer::compare(size_t pos_a, size_t pos_b) const {
     return 0;
 }
 
-size_t SearchBuffer::common_prefix_len(size_t pos_a, size_t pos_b) const {
-    for (size_t i = 0; i < LOOKAHEAD_SIZE; i++) {
+size_t SearchBuffer::common_prefix_len(size_t pos_a, size_t pos_b, size_t limit) const {
+    for (size_t i = 0; i < limit; i++) {
         if (pos_a + i >= buffer_size || pos_b + i >= buffer_size
             || buffer[pos_a + i] != buffer[pos_b + i]
         ) {
@@ -144,6 +158,6 @@ size_t SearchBuffer::common_prefix_len(size_t pos_a, size_t pos_b) const {
         }
     }
 
-    return LOOKAHEAD_SIZE;
+    return limit;
 }
 
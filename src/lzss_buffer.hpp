@@ -10,12 +10,18 @@
 #include <cstdint>
 
 #define SLIDING_WINDOW_SIZE 2048
+#define MIN_WINDOW_SIZE 256
+#define MAX_WINDOW_SIZE 65536
 #define LOOKAHEAD_SIZE 34
 #define MATCH_THRESHOLD 3
 
 class SearchBuffer {
 public:
-    SearchBuffer(const uint8_t* buffer, size_t buffer_size);
+    // lookahead: maximum match length the buffer reports, the tree itself
+    // is only ordered by the first LOOKAHEAD_SIZE bytes of each position
+    // window_size: number of most recent positions kept in the tree
+    SearchBuffer(const uint8_t* buffer, size_t buffer_size, size_t lookahead = LOOKAHEAD_SIZE,
+                 size_t window_size = SLIDING_WINDOW_SIZE);
 
     // Slide the window by n bytes, updating the binary search tree
     // to reflect the new positions of the data
@@ -38,35 +44,31 @@ private:
     };
 
     const uint8_t* buffer;
-    size_t buffer_size, window_pos;
+    size_t buffer_size, window_pos, lookahead, window_size, key_size;
     Node* root;
 
     // Delete the binary search tree starting from the given node
     void delete_tree(Node* node);
 
     // Insert a new node into the binary search tree
-    // Returns the new root of the tree
-    Node* insert_node(Node* node, size_t pos);
+    // If a node with the same key already exists, its position is replaced
+    // with the newer one, as it is always the closer match
+    void insert_node(size_t pos);
 
     // Delete a node from the binary search tree
-    // Returns the new root of the tree
-    Node* delete_node(Node* node, size_t pos);
-
-    // Find the best match node in the binary search tree
-    // starting from the given node
-    // Returns the position of the best match and updates best_len
-    // with the length of the match
-    size_t best_match_node(Node* node, size_t pos, size_t* best_len) const;
+    // Nothing is deleted if the position was already replaced by a newer one
+    void delete_node(size_t pos);
 
     // Compare two positions in the buffer
     // Returns a negative value if a < b, 0 if a == b, and a positive value if a > b
-    // The comparison is done byte by byte, up to LOOKAHEAD_SIZE bytes
+    // The comparison is done byte by byte, up to key_size bytes, a key cut short
+    // by the end of the buffer is smaller than any key it is a prefix of
     int16_t compare(size_t a, size_t b) const;
 
     // Find the length of the common prefix between two positions in the buffer
     // Returns the length of the common prefix
-    // The comparison is done byte by byte, up to LOOKAHEAD_SIZE bytes
-    size_t common_prefix_len(size_t a, size_t b) const;
+    // The comparison is done byte by byte, up to limit bytes
+    size_t common_prefix_len(size_t a, size_t b, size_t limit) const;
 };
 
 #endif
@@ -11,32 +11,115 @@
 #include <string>
 #include <vector>
 #include "includes/argparse.hpp"
+#include "dictionary.hpp"
 #include "serialization.hpp"
 
+// Read a whole file into data
+// Returns false if the file could not be read
+static bool read_file(const std::string& path, std::vector<uint8_t>& data) {
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream) {
+        return false;
+    }
+    data.resize(std::filesystem::file_size(path));
+    stream.read(reinterpret_cast<char*>(data.data()), data.size());
+    return (bool)stream;
+}
+
 int main(int argc, char *argv[]) {
     argparse::ArgumentParser program("lz_codec");
     auto &group = program.add_mutually_exclusive_group(true);
     group.add_argument("-c").help("Compression mode").flag();
     group.add_argument("-d").help("Decompression mode").flag();
+    group.add_argument("--train-dict").help("Dictionary training mode, trains a window-sized dictionary on the input files").flag();
     program.add_argument("-m").help("Activate preprocessing model").flag();
     program.add_argument("-a").help("Activate adaptive scanning mode").flag();
-    program.add_argument("-w").help("Image width [required with -c]").scan<'i', int>().metavar("width_value");
-    program.add_argument("-i").help("Input file").required().metavar("ifile");
+    program.add_argument("--wavelet").help("Use a 5/3 wavelet transform as the preprocessing model").flag();
+    program.add_argument("--context").help("Use the context modeling codec instead of LZSS (slower, best ratio)").flag();
+    program.add_argument("--tokens").help("LZSS token format (classic, varlen, soa)").default_value(std::string("classic"))
+        .choices("classic", "varlen", "soa").metavar("format");
+    program.add_argument("--window").help("Sliding window size, a power of two from 256 to 65536 (above 2048 classic tokens switch to varlen)")
+        .default_value(SLIDING_WINDOW_SIZE).scan<'i', int>().metavar("size");
+    program.add_argument("--rle").help("Collapse runs of equal bytes before LZSS").flag();
+    program.add_argument("--prime").help("Prime the window of adaptive blocks with the block above or to the left").flag();
+    program.add_argument("--quadtree").help("Split adaptive 128x128 superblocks into blocks down to 16x16").flag();
+    program.add_argument("--curves").help("Also try snake, Hilbert and Z-order scans of adaptive blocks").flag();
+    program.add_argument("--bitpack").help("Pack residuals at their bit width when it is smaller than LZSS").flag();
+    program.add_argument("--palette").help("Store images with at most 16 gray levels as packed palette indices").flag();
+    program.add_argument("--2d").help("Use row-to-row matches in non-adaptive mode (classic tokens switch to varlen)").flag();
+    program.add_argument("--entropy").help("Entropy coder of the LZSS streams (none, huffman, rans), implies soa tokens")
+        .default_value(std::string("none")).choices("none", "huffman", "rans").metavar("coder");
+    program.add_argument("--near").help("Near-lossless mode with the maximum absolute error per pixel, 0 to 32 (implies -m)")
+        .default_value(0).scan<'i', int>().metavar("k");
+    program.add_argument("--frames").help("Compress the input as a sequence of frames coded against the previous frame (requires -a)")
+        .default_value(1).scan<'i', int>().metavar("count");
+    program.add_argument("--bits").help("Bits per sample, 16-bit samples are little-endian and their byte planes are compressed separately")
+        .default_value(std::string("8")).choices("8", "16").metavar("bits");
+    program.add_argument("--channels").help("Channels of interleaved pixels, every channel is compressed as its own plane in parallel")
+        .default_value(std::string("1")).choices("1", "3", "4").metavar("count");
+    program.add_argument("--ycocg").help("Apply the reversible YCoCg-R color transform to the first three channels").flag();
+    program.add_argument("--cfa").help("Compress a Bayer mosaic as the four half-resolution planes of its 2x2 filter pattern").flag();
+    program.add_argument("-D").help("Preset dictionary file to compress or decompress with").metavar("dict");
+    program.add_argument("-w").help("Image width [required with -c and --train-dict]").scan<'i', int>().metavar("width_value");
+    program.add_argument("-i").help("Input file, repeated for every sample in dictionary training mode").required().append()
+        .metavar("ifile");
     program.add_argument("-o").help("Output file").required().metavar("ofile");
 
-    int width = 0;
-    bool compress_flag;
+    int width = 0, window_size = SLIDING_WINDOW_SIZE, near = 0, frames = 1, bytes_per_sample = 1, channels = 1;
+    bool compress_flag, train_flag;
+    std::vector<std::string> input_files;
     try {
         program.parse_args(argc, argv);
     
         compress_flag = program.is_used("-c");
-        if (compress_flag) {
+        train_flag = program.is_used("--train-dict");
+        input_files = program.get<std::vector<std::string>>("-i");
+        if (!train_flag && input_files.size() != 1) {
+            throw std::runtime_error("Error: A single input file must be given.");
+        }
+        if (compress_flag || train_flag) {
             width = program.get<int>("-w");
             if (width <= 0) {
                 throw std::runtime_error("Error: Width must be a positive integer.");
             } else if (width % 256 != 0) {
                 throw std::runtime_error("Error: Width must be a multiple of 256.");
             }
+
+            window_size = program.get<int>("--window");
+            if (window_size < MIN_WINDOW_SIZE || window_size > MAX_WINDOW_SIZE || (window_size & (window_size - 1)) != 0) {
+                throw std::runtime_error("Error: Window size must be a power of two from 256 to 65536.");
+            }
+
+            near = program.get<int>("--near");
+            if (near < 0 || near > MAX_NEAR) {
+                throw std::runtime_error("Error: Near-lossless error bound must be from 0 to 32.");
+            } else if (near > 0 && (program.is_used("--context") || program.is_used("--wavelet"))) {
+                throw std::runtime_error("Error: Near-lossless mode only works with the difference model.");
+            }
+
+            frames = program.get<int>("--frames");
+            if (frames < 1 || frames > 0xFFFF) {
+                throw std::runtime_error("Error: Frame count must be from 1 to 65535.");
+            } else if (frames > 1 && (!program.is_used("-a") || near > 0)) {
+                throw std::runtime_error("Error: Sequences need adaptive scanning mode and do not work in near-lossless mode.");
+            }
+            if (program.is_used("--quadtree") && (frames > 1 || program.is_used("--prime"))) {
+                throw std::runtime_error("Error: Quadtree blocks do not work with sequences or priming.");
+            }
+
+            bytes_per_sample = program.get<std::string>("--bits") == "16" ? 2 : 1;
+            if (bytes_per_sample == 2 && near > 0) {
+                throw std::runtime_error("Error: Near-lossless mode only works with 8-bit samples.");
+            }
+
+            channels = std::stoi(program.get<std::string>("--channels"));
+            if (program.is_used("--ycocg") && (channels == 1 || bytes_per_sample == 2)) {
+                throw std::runtime_error("Error: The color transform needs 3 or 4 channels of 8-bit samples.");
+            } else if (program.is_used("--ycocg") && near > 0) {
+                throw std::runtime_error("Error: The color transform does not work in near-lossless mode.");
+            } else if (program.is_used("--cfa") && (channels != 1 || width % 512 != 0)) {
+                throw std::runtime_error("Error: Mosaics must have a single channel and a width that is a multiple of 512.");
+            }
         }
     } catch (const std::exception& err) {
         std::cerr << err.what() << std::endl;
@@ -44,21 +127,80 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    std::string input_file = program.get<std::string>("-i");
+    CompressOptions options;
+    options.adaptive = program.is_used("-a");
+    options.model = program.is_used("--context") ? MODEL_CONTEXT
+        : program.is_used("--wavelet") ? MODEL_WAVELET
+        : program.is_used("-m") || near > 0 ? MODEL_DIFFERENCE : MODEL_NONE;
+    options.near = near;
+    options.rle = program.is_used("--rle");
+    options.palette = program.is_used("--palette");
+    options.bitpack = program.is_used("--bitpack");
+    options.scan_curves = program.is_used("--curves");
+    options.quadtree = program.is_used("--quadtree");
+    options.prime = program.is_used("--prime");
+    options.frames = frames;
+    options.bits = bytes_per_sample * 8;
+    options.channels = channels;
+    options.color_transform = program.is_used("--ycocg");
+    options.cfa = program.is_used("--cfa");
+    std::string tokens = program.get<std::string>("--tokens");
+    options.format = tokens == "soa" ? LZSS_FORMAT_SOA : tokens == "varlen" ? LZSS_FORMAT_VARLEN : LZSS_FORMAT_CLASSIC;
+    options.window_size = window_size;
+    options.match_2d = program.is_used("--2d");
+    std::string entropy = program.get<std::string>("--entropy");
+    options.entropy = entropy == "rans" ? LZSS_ENTROPY_RANS : entropy == "huffman" ? LZSS_ENTROPY_HUFFMAN : LZSS_ENTROPY_NONE;
+    if (options.entropy != LZSS_ENTROPY_NONE) {
+        options.format = LZSS_FORMAT_SOA; // only the SOA streams are entropy coded
+    }
+    if (options.format == LZSS_FORMAT_CLASSIC && (window_size > SLIDING_WINDOW_SIZE || options.match_2d)) {
+        options.format = LZSS_FORMAT_VARLEN; // classic tags can not address a larger window or 2D matches
+    }
+    if (program.is_used("-D") && !read_file(program.get<std::string>("-D"), options.dictionary)) {
+        std::cerr << "Error: Could not read dictionary file " << program.get<std::string>("-D") << std::endl;
+        return 1;
+    }
+
+    std::string output_file = program.get<std::string>("-o");
+    if (train_flag) {
+        // The samples are preprocessed with the model and scanning mode the dictionary is meant for
+        std::vector<uint8_t> corpus, sample, dictionary;
+        for (const std::string& file : input_files) {
+            if (!read_file(file, sample)) {
+                std::cerr << "Error: Could not read input file " << file << std::endl;
+                return 1;
+            } else if (sample.size() % width != 0) {
+                std::cerr << "Error: Size of input file " << file << " is not a multiple of the width." << std::endl;
+                return 1;
+            }
+            dictionary_samples(sample.data(), sample.size(), width, options, corpus);
+        }
+        train_dictionary(corpus, window_size, dictionary);
+
+        std::ofstream dictionary_stream(output_file, std::ios::binary);
+        if (!dictionary_stream) {
+            std::cerr << "Error: Could not open output file " << output_file << std::endl;
+            return 1;
+        }
+        dictionary_stream.write(reinterpret_cast<const char*>(dictionary.data()), dictionary.size());
+        return 0;
+    }
+
+    std::string input_file = input_files[0];
     std::ifstream input_file_stream(input_file, std::ios::binary);
     if (!input_file_stream) {
         std::cerr << "Error: Could not open input file " << input_file << std::endl;
         return 1;
     }
     auto size = std::filesystem::file_size(input_file);
-    if (compress_flag && size / width % 256 != 0) {
-        std::cerr << "Error: Input height must be a multiple of 256." << std::endl;
+    size_t frame_row = (size_t)width * frames * bytes_per_sample * channels;
+    if (compress_flag && (size % frame_row != 0 || size / frame_row % 256 != 0)) {
+        std::cerr << "Error: Input height of every frame must be a multiple of 256." << std::endl;
         return 1;
     }
     std::unique_ptr<uint8_t[]> input_buffer(new uint8_t[size]);
     input_file_stream.read(reinterpret_cast<char*>(input_buffer.get()), size);
 
-    std::string output_file = program.get<std::string>("-o");
     std::ofstream output_file_stream(output_file, std::ios::binary);
     if (!output_file_stream) {
         std::cerr << "Error: Could not open output file " << output_file << std::endl;
@@ -66,12 +208,13 @@ int main(int argc, char *argv[]) {
     }
     
     size_t output_size;
+    CompressStats stats;
     std::vector<uint8_t> output_buffer;
     output_buffer.reserve(size);
     if (compress_flag) {
-        output_size = compress(input_buffer.get(), size, width, program.is_used("-a"), program.is_used("-m"), output_buffer);
+        output_size = compress(input_buffer.get(), size, width, options, output_buffer, &stats);
     } else {
-        output_size = decompress(input_buffer.get(), size, output_buffer);
+        output_size = decompress(input_buffer.get(), size, output_buffer, options.dictionary);
         if (output_size == 0) {
             std::cerr << "Error: Decompression failed." << std::endl;
             return 1;
@@ -82,6 +225,14 @@ int main(int argc, char *argv[]) {
     #ifdef DEBUG
     std::cout << "Input file size: " << size << " bytes" << std::endl;
     std::cout << "Output file size: " << output_size << " bytes" << std::endl;
+    if (compress_flag) {
+        std::cout << "Blocks: " << stats.blocks << " (" << stats.constant_blocks << " constant, "
+                  << stats.raw_blocks << " raw, " << stats.packed_blocks << " packed, "
+                  << stats.duplicate_blocks << " duplicate, " << stats.unchanged_blocks << " unchanged, "
+                  << stats.inter_blocks << " inter, " << stats.curve_blocks << " curve)" << std::endl;
+        std::cout << "Skipped as incompressible: " << stats.skipped_trials << " LZSS runs, "
+                  << stats.skipped_bytes << " bytes not searched" << std::endl;
+    }
     #endif
 
     return 0;
@@ -0,0 +1,182 @@
+// rans.cpp
+// Source file for the interleaved static rANS coder used as the entropy stage
+// on the LZSS streams.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "rans.hpp"
+
+// The coded stream starts with the frequency table, a zero byte is followed
+// by a byte giving a run of 1-256 unused symbols, frequencies below 0x80
+// take a byte, larger ones two bytes with the top bit of the first one set
+// The final encoder states of all lanes follow, 4 bytes each, then the
+// renormalization words, 2 bytes each, in the order the decoder reads them
+// States are kept within [RANS_LOW, RANS_LOW << 16), so a single word
+// is enough to renormalize after every symbol
+#define RANS_SYMBOLS 256
+#define RANS_PROB_BITS 12
+#define RANS_PROB_SCALE (1 << RANS_PROB_BITS)
+#define RANS_LOW (1u << 16)
+#define RANS_WORD_BITS 16
+
+// Scale the symbol counts to frequencies summing to RANS_PROB_SCALE,
+// every symbol present in the input keeps a nonzero frequency
+static void normalize_freqs(const size_t* counts, size_t total, uint32_t* freqs) {
+    uint32_t sum = 0;
+    size_t largest = 0;
+    for (size_t s = 0; s < RANS_SYMBOLS; s++) {
+        freqs[s] = counts[s] ? std::max((size_t)1, counts[s] * RANS_PROB_SCALE / total) : 0;
+        sum += freqs[s];
+        if (counts[s] > counts[largest]) {
+            largest = s;
+        }
+    }
+
+    // Rounding down leaves a remainder, which goes to the most frequent symbol,
+    // the minimum frequency of rare symbols can overshoot, which is taken
+    // from the currently largest frequencies
+    if (sum < RANS_PROB_SCALE) {
+        freqs[largest] += RANS_PROB_SCALE - sum;
+    }
+    while (sum > RANS_PROB_SCALE) {
+        size_t s = std::max_element(freqs, freqs + RANS_SYMBOLS) - freqs;
+        freqs[s]--;
+        sum--;
+    }
+}
+
+void rans_encode(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output) {
+    size_t counts[RANS_SYMBOLS] = {0};
+    for (size_t i = 0; i < input_size; i++) {
+        counts[input[i]]++;
+    }
+    uint32_t freqs[RANS_SYMBOLS], cumulative[RANS_SYMBOLS];
+    normalize_freqs(counts, input_size, freqs);
+    for (size_t s = 0, sum = 0; s < RANS_SYMBOLS; s++) {
+        cumulative[s] = sum;
+        sum += freqs[s];
+    }
+
+    for (size_t s = 0; s < RANS_SYMBOLS;) {
+        if (freqs[s] == 0) {
+            size_t run = 1;
+            while (s + run < RANS_SYMBOLS && freqs[s + run] == 0) {
+                run++;
+            }
+            output.push_back(0);
+            output.push_back(run - 1);
+            s += run;
+            continue;
+        }
+        if (freqs[s] < 0x80) {
+            output.push_back(freqs[s]);
+        } else {
+            output.push_back(0x80 | freqs[s] >> 8);
+            output.push_back(freqs[s] & 0xFF);
+        }
+        s++;
+    }
+
+    // The symbols are encoded in reverse, so the decoder gets them in order
+    uint32_t states[RANS_LANES];
+    std::fill(states, states + RANS_LANES, RANS_LOW);
+    std::vector<uint16_t> words;
+    for (size_t i = input_size; i-- > 0;) {
+        uint32_t& x = states[i % RANS_LANES];
+        uint32_t freq = freqs[input[i]];
+        uint64_t x_max = (uint64_t)((RANS_LOW >> RANS_PROB_BITS) << RANS_WORD_BITS) * freq;
+        if (x >= x_max) {
+            words.push_back(x & 0xFFFF);
+            x >>= RANS_WORD_BITS;
+        }
+        x = ((x / freq) << RANS_PROB_BITS) + (x % freq) + cumulative[input[i]];
+    }
+
+    for (size_t lane = 0; lane < RANS_LANES; lane++) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            output.push_back((states[lane] >> shift) & 0xFF);
+        }
+    }
+    for (size_t i = words.size(); i-- > 0;) {
+        output.push_back(words[i] & 0xFF);
+        output.push_back(words[i] >> 8);
+    }
+}
+
+bool rans_decode(const uint8_t* input, size_t input_size, uint8_t* output, size_t count) {
+    uint32_t freqs[RANS_SYMBOLS], cumulative[RANS_SYMBOLS];
+    size_t pos = 0, sum = 0;
+    for (size_t s = 0; s < RANS_SYMBOLS;) {
+        if (pos + 1 >= input_size) {
+            return false;
+        }
+        uint8_t byte = input[pos++];
+        if (byte == 0) {
+            size_t run = input[pos++] + 1;
+            if (s + run > RANS_SYMBOLS) {
+                return false;
+            }
+            for (; run > 0; run--, s++) {
+                freqs[s] = 0;
+                cumulative[s] = sum;
+            }
+            continue;
+        }
+        freqs[s] = byte < 0x80 ? byte : (byte & 0x7F) << 8 | input[pos++];
+        cumulative[s] = sum;
+        sum += freqs[s];
+        s++;
+    }
+    if (sum != RANS_PROB_SCALE || input_size - pos < RANS_LANES * 4 || (input_size - pos) % 2 != 0) {
+        return false;
+    }
+
+    std::vector<uint8_t> slot_symbols(RANS_PROB_SCALE);
+    for (size_t s = 0; s < RANS_SYMBOLS; s++) {
+        std::fill(slot_symbols.begin() + cumulative[s], slot_symbols.begin() + cumulative[s] + freqs[s], s);
+    }
+
+    uint32_t states[RANS_LANES];
+    for (size_t lane = 0; lane < RANS_LANES; lane++, pos += 4) {
+        states[lane] = input[pos] | input[pos + 1] << 8 | input[pos + 2] << 16 | (uint32_t)input[pos + 3] << 24;
+    }
+    size_t word_count = (input_size - pos) / 2;
+    std::vector<uint16_t> words(word_count + 1, 0); // padded so a read past the end is harmless
+    for (size_t i = 0; i < word_count; i++, pos += 2) {
+        words[i] = input[pos] | input[pos + 1] << 8;
+    }
+
+    // Renormalization is a select instead of a branch, the word
+    // is read in any case and only consumed when needed
+    size_t word_pos = 0;
+    auto step = [&](uint32_t& x) {
+        uint32_t slot = x & (RANS_PROB_SCALE - 1);
+        uint8_t symbol = slot_symbols[slot];
+        x = freqs[symbol] * (x >> RANS_PROB_BITS) + slot - cumulative[symbol];
+        bool renormalize = x < RANS_LOW;
+        uint32_t word = words[std::min(word_pos, word_count)];
+        x = renormalize ? x << RANS_WORD_BITS | word : x;
+        word_pos += renormalize;
+        return symbol;
+    };
+
+    size_t i = 0;
+    for (; i + RANS_LANES <= count; i += RANS_LANES) {
+        for (size_t lane = 0; lane < RANS_LANES; lane++) {
+            output[i + lane] = step(states[lane]);
+        }
+    }
+    for (; i < count; i++) {
+        output[i] = step(states[i % RANS_LANES]);
+    }
+
+    // A valid stream uses up all the words and leaves the states where the encoder started
+    for (size_t lane = 0; lane < RANS_LANES; lane++) {
+        if (states[lane] != RANS_LOW) {
+            return false;
+        }
+    }
+    return word_pos == word_count;
+}
@@ -0,0 +1,29 @@
+// rans.hpp
+// Header file for the interleaved static rANS coder used as the entropy stage
+// on the LZSS streams.
+
+#ifndef RANS_HPP
+#define RANS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Number of interleaved states, symbol i is coded by state i % RANS_LANES
+// so the decoder can work on the independent states in parallel
+#define RANS_LANES 8
+
+// Compress a byte stream with static frequencies counted for it
+// input: pointer to the input data
+// input_size: size of the input data
+// output: vector the frequency table and the coded data are appended to
+void rans_encode(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output);
+
+// Decompress a byte stream compressed by rans_encode
+// input: pointer to the compressed data
+// input_size: size of the compressed data
+// output: buffer for count decoded bytes
+// Returns false if the input is invalid
+bool rans_decode(const uint8_t* input, size_t input_size, uint8_t* output, size_t count);
+
+#endif
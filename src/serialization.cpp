@@ -4,17 +4,328 @@
 // binary data based on scanning mode and transformation model.
 
 #include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#include "bitpack.hpp"
+#include "context_model.hpp"
+#include "dictionary.hpp"
 #include "lzss.hpp"
 #include "serialization.hpp"
+#include "wavelet.hpp"
 
 #define BLOCK_SIZE 64
 #define BLOCK_BYTE_SIZE (BLOCK_SIZE * BLOCK_SIZE)
 
-void apply_difference(uint8_t* buffer, size_t width, size_t height) {
+// Header layout:
+// [0] image width / 256
+// [1] header version (upper nibble) and model (lower nibble)
+// [2] block count upper, [3] block count lower
+// Version 1 continues with the length of the extension fields
+// and the fields themselves, fields missing from a shorter
+// extension take their default values:
+// [0] LZSS token format
+// [1] log2 of the LZSS sliding window size
+// [2] entropy coder of the SOA streams
+// [3] maximum absolute error of the near-lossless difference model
+// [4] 1 if the RLE pre-pass runs before LZSS, 0 otherwise
+// [5] number of palette entries, 0 without a palette, the palette
+//     values follow the extension fields
+// [6] 1 if the blocks are split by quadtrees of superblocks, 0 otherwise
+// [7] 1 if the LZSS streams of adaptive blocks are primed with
+//     their neighbouring block, 0 otherwise
+// [8-11] id of the preset dictionary (little-endian), 0 without a dictionary
+// [12-13] number of frames of a sequence (little-endian), 1 for a single image,
+//         the frames follow one after another, each with block count blocks
+// [14] bits per sample, 8 or 16, 16-bit images are followed by their high and
+//      low byte planes, each as its 4-byte little-endian size and a complete
+//      compressed 8-bit image, the model of the header is applied to the 16-bit
+//      samples and the block count is 0
+// [15] number of channels of interleaved pixels, 1, 3 or 4, images with more
+//      channels are followed by a plane per channel, stored as the byte planes
+//      of 16-bit images, the model and near-lossless bound of the header are
+//      those of the planes and the block count is unused
+// [16] 1 if the first three channels went through the YCoCg-R transform
+//      modulo 256, 0 otherwise
+// [17] 1 if the image is a color filter array mosaic, which is followed by the
+//      four planes of its 2x2 filter pattern, stored as the channel planes
+// [18] 1 if bits 2-7 of the block flag bytes are used, 0 if every block is
+//      stored in the row scan or its transpose as the base version does,
+//      so readers of the base version reject streams with newer blocks
+#define HEADER_BASE_SIZE 4
+#define HEADER_VERSION_SHIFT 4
+#define HEADER_MODEL_MASK 0x0F
+#define HEADER_VERSION_EXTENDED 1
+
+// Every block starts with a flag byte and the 4-byte compressed size
+// Flag byte: bit 0 been encoded, bit 1 horizontal, bits 2-3 scan order,
+// bits 4-7 block mode
+// CODED: the block is stored as the flags say
+// CONSTANT: all pixels of the block have the value of the single payload byte
+// NEAR_CONSTANT: all pixels are within the near-lossless error bound
+// of the single payload byte
+// PACKED: the block is packed at the bit width of its residuals instead
+// of going through LZSS, the other flags apply as for CODED
+// COPY: the block repeats an earlier block of the same size, the 4-byte
+// little-endian payload is the index of the earlier block in the fixed block
+// grid, in quadtree mode the index of its top left QUADTREE_MIN_SIZE cell
+// UNCHANGED: the block is the co-located block of the previous frame,
+// without a payload
+// INTER: the block is stored as its difference from the co-located block
+// of the previous frame modulo 256, in the row scan without the model,
+// bit 0 tells if the difference has been encoded
+#define BLOCK_HEADER_SIZE 5
+#define BLOCK_MODE_SHIFT 4
+#define BLOCK_MODE_CODED 0
+#define BLOCK_MODE_CONSTANT 1
+#define BLOCK_MODE_NEAR_CONSTANT 2
+#define BLOCK_MODE_PACKED 3
+#define BLOCK_MODE_COPY 4
+#define BLOCK_MODE_UNCHANGED 5
+#define BLOCK_MODE_INTER 6
+#define BLOCK_COPY_SIZE 4
+
+// Blocks of a sequence whose difference from the previous frame codes below
+// 1 / INTER_GOOD_RATIO of the block are kept without trying the block on its own
+#define INTER_GOOD_RATIO 16
+
+// Scan orders of adaptive blocks, ROWS is the row by row scan or its
+// transpose as given by the horizontal flag, the others are fixed paths
+// through the block and used with the horizontal flag set
+// SNAKE: rows with every other row reversed
+// HILBERT: the Hilbert curve
+// MORTON: the Z-order curve
+#define SCAN_ORDER_SHIFT 2
+#define SCAN_ORDER_MASK 0x03
+#define SCAN_ROWS 0
+#define SCAN_SNAKE 1
+#define SCAN_HILBERT 2
+#define SCAN_MORTON 3
+#define SCAN_ORDERS 4
+
+// Quadtree mode: the image is divided into superblocks, which are split
+// into quarters down to QUADTREE_MIN_SIZE, every superblock starts with
+// the 3-byte little-endian split tree, a bit per node larger than
+// QUADTREE_MIN_SIZE in preorder, 1 if the node is split, followed by
+// the blocks of the leaves in the same order
+// A split must reduce the estimated cost by 1 / QUADTREE_SPLIT_GAIN,
+// superblocks with a mean gradient above QUADTREE_BUSY_GRADIENT are split
+// as well, nodes where at least one in QUADTREE_MATCH_RATIO positions repeats
+// an earlier position are coded both ways instead
+#define SUPERBLOCK_SIZE 128
+#define SUPERBLOCK_BYTE_SIZE (SUPERBLOCK_SIZE * SUPERBLOCK_SIZE)
+#define QUADTREE_MIN_SIZE 16
+#define SUPERBLOCK_CELLS (SUPERBLOCK_SIZE / QUADTREE_MIN_SIZE)
+#define QUADTREE_TREE_SIZE 3
+#define QUADTREE_SPLIT_GAIN 8
+#define QUADTREE_BUSY_GRADIENT 4
+#define QUADTREE_MATCH_RATIO 2
+
+// Incompressibility check: data is stored raw without running LZSS when
+// fewer than one in INCOMPRESSIBLE_MATCH_RATIO positions repeats the 3 bytes
+// of an earlier position within the window and, if an entropy coder would
+// code the literals, their order-0 entropy is above INCOMPRESSIBLE_ENTROPY
+// The hash only remembers the last position per bucket, so the check is not
+// made for windows larger than the hash table or with 2D matches
+#define INCOMPRESSIBLE_HASH_BITS 12
+#define INCOMPRESSIBLE_MATCH_RATIO 64
+#define INCOMPRESSIBLE_ENTROPY 7.5
+
+// RLE pre-pass: two equal bytes in a row are always followed by a byte
+// with the number of further repeats, 0-255
+#define RLE_MAX_EXTRA 0xFF
+
+// Palette packing: images with few distinct values are stored as indices
+// into the palette, packed 8, 4 or 2 to a byte with the first pixel
+// in the lowest bits
+#define PALETTE_MAX_SIZE 16
+
+// Largest number of planes an image is split into, channels of interleaved
+// pixels or the planes of a color filter array mosaic
+#define MAX_CHANNELS 4
+#define CFA_PLANES 4
+
+struct Header {
+    size_t width = 0;
+    uint8_t model = MODEL_NONE;
+    size_t block_count = 0;
+    uint8_t near = 0;
+    bool rle = false;
+    std::vector<uint8_t> palette; // empty if the pixels are not packed
+    bool quadtree = false;
+    bool prime = false;
+    uint32_t dictionary_id = 0; // 0 without a dictionary
+    std::vector<uint8_t> dictionary; // contents of the dictionary, not stored in the header
+    size_t frames = 1;
+    uint8_t bits = 8;
+    size_t channels = 1;
+    bool color_transform = false;
+    bool cfa = false;
+    bool block_modes = false; // blocks use the scan order and block mode bits of the flag byte
+    LzssOptions lzss;
+};
+
+// Returns the base 2 logarithm of a power of two size
+uint8_t log2_size(size_t size) {
+    uint8_t log = 0;
+    while (((size_t)1 << log) < size) {
+        log++;
+    }
+    return log;
+}
+
+// Write the header, the base version is used when no extension field
+// differs from its default so the output stays readable by older versions
+void write_header(const Header& header, std::vector<uint8_t>& output) {
+    bool extended = header.lzss.format != LZSS_FORMAT_CLASSIC
+        || header.lzss.window_size != SLIDING_WINDOW_SIZE
+        || header.lzss.entropy != LZSS_ENTROPY_NONE
+        || header.near != 0
+        || header.rle
+        || !header.palette.empty()
+        || header.quadtree
+        || header.prime
+        || header.dictionary_id != 0
+        || header.frames != 1
+        || header.bits != 8
+        || header.channels != 1
+        || header.cfa
+        || header.block_modes;
+
+    output.push_back(header.width / 256); // block width byte [0]
+    output.push_back((extended ? HEADER_VERSION_EXTENDED << HEADER_VERSION_SHIFT : 0) | header.model); // version and model [1]
+    output.push_back((header.block_count >> 8) & 0xff); // block count upper [2]
+    output.push_back(header.block_count & 0xff); // block count lower [3]
+
+    if (extended) {
+        std::vector<uint8_t> extension;
+        extension.push_back(header.lzss.format);
+        extension.push_back(log2_size(header.lzss.window_size));
+        extension.push_back(header.lzss.entropy);
+        extension.push_back(header.near);
+        extension.push_back(header.rle ? 1 : 0);
+        extension.push_back(header.palette.size());
+        extension.push_back(header.quadtree ? 1 : 0);
+        extension.push_back(header.prime ? 1 : 0);
+        for (int shift = 0; shift < 32; shift += 8) {
+            extension.push_back((header.dictionary_id >> shift) & 0xFF);
+        }
+        extension.push_back(header.frames & 0xFF);
+        extension.push_back((header.frames >> 8) & 0xFF);
+        extension.push_back(header.bits);
+        extension.push_back(header.channels);
+        extension.push_back(header.color_transform ? 1 : 0);
+        extension.push_back(header.cfa ? 1 : 0);
+        extension.push_back(header.block_modes ? 1 : 0);
+
+        output.push_back(extension.size());
+        output.insert(output.end(), extension.begin(), extension.end());
+        output.insert(output.end(), header.palette.begin(), header.palette.end());
+    }
+}
+
+// Read the header
+// Returns the size of the header, 0 if the header is invalid
+size_t read_header(const uint8_t* input, size_t input_size, Header& header) {
+    if (input_size < HEADER_BASE_SIZE) {
+        return 0;
+    }
+
+    header.width = input[0] * 256;
+    header.model = input[1] & HEADER_MODEL_MASK;
+    header.block_count = input[3] | (input[2] << 8);
+
+    uint8_t version = input[1] >> HEADER_VERSION_SHIFT;
+    if (header.model > MODEL_WAVELET) {
+        return 0;
+    } else if (version == 0) {
+        return HEADER_BASE_SIZE;
+    } else if (version != HEADER_VERSION_EXTENDED || input_size < HEADER_BASE_SIZE + 1) {
+        return 0;
+    }
+
+    size_t extension_size = input[HEADER_BASE_SIZE];
+    const uint8_t* extension = input + HEADER_BASE_SIZE + 1;
+    if (input_size < HEADER_BASE_SIZE + 1 + extension_size) {
+        return 0;
+    }
+    auto field = [&](size_t index, uint8_t fallback) {
+        return index < extension_size ? extension[index] : fallback;
+    };
+
+    header.lzss.format = field(0, LZSS_FORMAT_CLASSIC);
+    header.lzss.window_size = (size_t)1 << field(1, log2_size(SLIDING_WINDOW_SIZE));
+    header.lzss.entropy = field(2, LZSS_ENTROPY_NONE);
+    header.near = field(3, 0);
+    header.rle = field(4, 0) == 1;
+    header.quadtree = field(6, 0) == 1;
+    header.prime = field(7, 0) == 1;
+    header.dictionary_id = field(8, 0) | field(9, 0) << 8 | field(10, 0) << 16 | (uint32_t)field(11, 0) << 24;
+    header.frames = field(12, 1) | field(13, 0) << 8;
+    header.bits = field(14, 8);
+    header.channels = field(15, 1);
+    header.color_transform = field(16, 0) == 1;
+    header.cfa = field(17, 0) == 1;
+    header.block_modes = field(18, 0) == 1;
+    if (header.lzss.format > LZSS_FORMAT_SOA
+        || field(4, 0) > 1
+        || field(6, 0) > 1
+        || field(7, 0) > 1
+        || (header.prime && (header.rle || header.near != 0 || header.quadtree || header.model == MODEL_CONTEXT))
+        || header.frames == 0
+        || (header.frames > 1 && (header.block_count <= 1 || header.quadtree || header.near != 0))
+        || (header.bits != 8 && header.bits != 16)
+        || (header.bits == 16 && (header.near != 0 || field(5, 0) != 0))
+        || (header.channels != 1 && header.channels != 3 && header.channels != 4)
+        || field(16, 0) > 1
+        || (header.color_transform && (header.channels == 1 || header.bits != 8 || header.near != 0))
+        || field(17, 0) > 1
+        || field(18, 0) > 1
+        || (header.cfa && (header.channels != 1 || header.width % 512 != 0))
+        || header.near > MAX_NEAR
+        || (header.near != 0 && header.model != MODEL_DIFFERENCE)
+        || header.lzss.entropy > LZSS_ENTROPY_RANS
+        || (header.lzss.format != LZSS_FORMAT_SOA && header.lzss.entropy != LZSS_ENTROPY_NONE)
+        || header.lzss.window_size < MIN_WINDOW_SIZE || header.lzss.window_size > MAX_WINDOW_SIZE
+        || (header.lzss.format == LZSS_FORMAT_CLASSIC && header.lzss.window_size > SLIDING_WINDOW_SIZE)
+    ) {
+        return 0;
+    }
+
+    size_t palette_size = field(5, 0);
+    if (palette_size > PALETTE_MAX_SIZE || (palette_size != 0 && header.model != MODEL_NONE)
+        || input_size < HEADER_BASE_SIZE + 1 + extension_size + palette_size
+    ) {
+        return 0;
+    }
+    header.palette.assign(extension + extension_size, extension + extension_size + palette_size);
+
+    return HEADER_BASE_SIZE + 1 + extension_size + palette_size;
+}
+
+// With near > 0 the differences are quantized to multiples of 2 * near + 1
+// as in JPEG-LS, every difference is taken from the value the decoder
+// reconstructs so the error can not build up along the row
+// The quantized differences are stored as signed bytes
+void apply_difference(uint8_t* buffer, size_t width, size_t height, uint8_t near) {
+    if (near > 0) {
+        int step = 2 * near + 1;
+        for (size_t y = 0; y < height; y++) {
+            int reconstructed = buffer[y * width];
+            for (size_t x = 1; x < width; x++) {
+                int error = buffer[y * width + x] - reconstructed;
+                int quantized = error >= 0 ? (error + near) / step : -((near - error) / step);
+                reconstructed = std::clamp(reconstructed + quantized * step, 0, 255);
+                buffer[y * width + x] = (uint8_t)(int8_t)quantized;
+            }
+        }
+        return;
+    }
+
     for (size_t y = 0; y < height; y++) {
         uint8_t last_value = buffer[y * width];
         for (size_t x = 1; x < width; x++) {
@@ -25,7 +336,18 @@ void apply_difference(uint8_t* buffer, size_t width, size_t height) {
     }
 }
 
-void remove_difference(uint8_t* buffer, size_t width, size_t height) {
+void remove_difference(uint8_t* buffer, size_t width, size_t height, uint8_t near) {
+    if (near > 0) {
+        int step = 2 * near + 1;
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 1; x < width; x++) {
+                int quantized = (int8_t)buffer[y * width + x];
+                buffer[y * width + x] = std::clamp(buffer[y * width + x - 1] + quantized * step, 0, 255);
+            }
+        }
+        return;
+    }
+
     for (size_t y = 0; y < height; y++) {
         for (size_t x = 1; x < width; x++) {
             buffer[y * width + x] += buffer[y * width + x - 1];
@@ -33,159 +355,1392 @@ void remove_difference(uint8_t* buffer, size_t width, size_t height) {
     }
 }
 
-void transpose_block(uint8_t* buffer) {
-    for (size_t i = 0; i < BLOCK_SIZE; i++) {
-        for (size_t j = i + 1; j < BLOCK_SIZE; j++) {
-            std::swap(buffer[i * BLOCK_SIZE + j], buffer[j * BLOCK_SIZE + i]);
+// Find the smallest and largest value of a block in a single pass,
+// the loop has no dependencies between iterations and vectorizes
+void block_range(const uint8_t* buffer, size_t size, uint8_t& min_value, uint8_t& max_value) {
+    uint8_t low = 0xFF, high = 0;
+    for (size_t i = 0; i < size; i++) {
+        low = std::min(low, buffer[i]);
+        high = std::max(high, buffer[i]);
+    }
+    min_value = low;
+    max_value = high;
+}
+
+// Number of positions whose 3 bytes repeat the last earlier position
+// with the same hash within the window, a cheap estimate of the matches
+// history: data in front of the buffer that matches can reach into, only hashed
+size_t repeat_hits(const uint8_t* history, size_t history_size, const uint8_t* buffer, size_t size, size_t window_size) {
+    std::vector<uint8_t> primed;
+    if (history_size > 0) {
+        primed.assign(history, history + history_size);
+        primed.insert(primed.end(), buffer, buffer + size);
+        buffer = primed.data();
+        size += history_size;
+    }
+
+    std::vector<uint32_t> last_seen(1 << INCOMPRESSIBLE_HASH_BITS, 0); // position + 1, 0 if empty
+    size_t hits = 0;
+    for (size_t i = 0; i + MATCH_THRESHOLD <= size; i++) {
+        uint32_t key = buffer[i] | buffer[i + 1] << 8 | buffer[i + 2] << 16;
+        uint32_t hash = (key * 2654435761u) >> (32 - INCOMPRESSIBLE_HASH_BITS);
+        size_t candidate = last_seen[hash];
+        if (i >= history_size && candidate != 0 && i - (candidate - 1) <= window_size && memcmp(buffer + candidate - 1, buffer + i, MATCH_THRESHOLD) == 0) {
+            hits++;
         }
+        last_seen[hash] = i + 1;
     }
+    return hits;
 }
 
-size_t compress(uint8_t* input, size_t input_size, size_t width, bool adaptive, bool model, std::vector<uint8_t>& output) {
-    output.reserve(input_size / 2);
-    output.push_back(width / 256); // block width byte [0]
-    output.push_back(model ? 1 : 0); // model used flag [1]
-
-    if (adaptive) {
-        uint8_t horizontal_block[BLOCK_BYTE_SIZE];
-        uint8_t vertical_block[BLOCK_BYTE_SIZE];
-        std::vector<uint8_t> horizontal_output;
-        horizontal_output.reserve(BLOCK_BYTE_SIZE);
-        std::vector<uint8_t> vertical_output;
-        vertical_output.reserve(BLOCK_BYTE_SIZE);
-        
-        size_t height = input_size / width;
-        size_t block_count = (width / BLOCK_SIZE) * (height / BLOCK_SIZE);
-        output.push_back((block_count >> 8) & 0xff); // block count upper [3]
-        output.push_back(block_count & 0xff); // block count lower [2]
-        
-        for (size_t y = 0; y < height; y += BLOCK_SIZE) {
-            for (size_t x = 0; x < width; x += BLOCK_SIZE) {
-                output.push_back(0); // scanning direction and been encoded flags placeholder
-
-                for (size_t by = 0; by < BLOCK_SIZE; by++) {
-                    memcpy(
-                        horizontal_block + by * BLOCK_SIZE,
-                        input + (y + by) * width + x,
-                        std::min((size_t)BLOCK_SIZE, width - x)
-                    );
+// Decide whether the data is not worth running through LZSS, using
+// a byte histogram and a hash of the 3 bytes at every position
+bool looks_incompressible(const uint8_t* buffer, size_t size, const LzssOptions& lzss) {
+    if (lzss.stride != 0 || lzss.window_size > (size_t)1 << INCOMPRESSIBLE_HASH_BITS) {
+        return false;
+    } else if (repeat_hits(lzss.history, lzss.history_size, buffer, size, lzss.window_size) * INCOMPRESSIBLE_MATCH_RATIO >= size) {
+        return false;
+    } else if (lzss.entropy == LZSS_ENTROPY_NONE) {
+        return true;
+    }
+
+    size_t histogram[256] = {0};
+    for (size_t i = 0; i < size; i++) {
+        histogram[buffer[i]]++;
+    }
+    double entropy = 0;
+    for (size_t count : histogram) {
+        if (count) {
+            double p = (double)count / size;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy > INCOMPRESSIBLE_ENTROPY;
+}
+
+// Collapse runs of equal bytes into the byte twice and a repeat count
+void rle_encode(const uint8_t* buffer, size_t size, std::vector<uint8_t>& output) {
+    for (size_t i = 0; i < size;) {
+        uint8_t value = buffer[i];
+        size_t run = 1;
+        while (i + run < size && buffer[i + run] == value && run < 2 + RLE_MAX_EXTRA) {
+            run++;
+        }
+        output.push_back(value);
+        if (run >= 2) {
+            output.push_back(value);
+            output.push_back(run - 2);
+        }
+        i += run;
+    }
+}
+
+// Expand the output of rle_encode
+// Returns false if the input is invalid
+bool rle_decode(const uint8_t* buffer, size_t size, std::vector<uint8_t>& output) {
+    for (size_t i = 0; i < size;) {
+        uint8_t value = buffer[i++];
+        output.push_back(value);
+        if (i < size && buffer[i] == value) {
+            if (i + 1 >= size) {
+                return false;
+            }
+            output.insert(output.end(), buffer[i + 1] + 1, value);
+            i += 2;
+        }
+    }
+    return true;
+}
+
+// Compress data with LZSS, after the RLE pre-pass if it is enabled, with bitpack
+// the packed residuals are used instead when they are smaller
+// block_mode: set to the mode of the block the data is stored in
+// Returns the size of the compressed data, size if compression failed
+size_t compress_stream(const uint8_t* buffer, size_t size, std::vector<uint8_t>& output, const LzssOptions& lzss, bool rle,
+                       bool bitpack, uint8_t& block_mode, CompressStats* stats) {
+    std::vector<uint8_t> runs;
+    const uint8_t* data = buffer;
+    size_t data_size = size;
+    if (rle) {
+        rle_encode(buffer, size, runs);
+        data = runs.data();
+        data_size = runs.size();
+    }
+
+    block_mode = BLOCK_MODE_CODED;
+    size_t start = output.size();
+    size_t compressed_size = size;
+    if (looks_incompressible(data, data_size, lzss)) {
+        stats->skipped_trials++;
+        stats->skipped_bytes += data_size;
+    } else {
+        compressed_size = lzss_compress(data, data_size, output, lzss);
+        compressed_size = compressed_size >= std::min(size, data_size) ? size : compressed_size;
+    }
+
+    if (bitpack) {
+        std::vector<uint8_t> packed;
+        size_t packed_size = bitpack_encode(buffer, size, packed);
+        if (packed_size < compressed_size) {
+            block_mode = BLOCK_MODE_PACKED;
+            output.resize(start);
+            output.insert(output.end(), packed.begin(), packed.end());
+            return packed_size;
+        }
+    }
+    return compressed_size;
+}
+
+// Split 16-bit little-endian samples into their high and low byte planes
+// With the difference model the samples are replaced by the differences
+// of neighbouring samples in a row first, taken modulo 65536, so smooth
+// images leave mostly 0x00 and 0xFF in the high plane
+// The prediction always runs along whole rows of the image, before the planes
+// are split into blocks, so a transposed block of a plane holds the transposed
+// horizontal differences rather than vertical ones, and images that predict
+// better from the row above do not benefit from the adaptive mode here
+void split_planes(const uint8_t* input, size_t width, size_t height, bool difference, std::vector<uint8_t>& high,
+                  std::vector<uint8_t>& low) {
+    high.resize(width * height);
+    low.resize(width * height);
+    for (size_t y = 0; y < height; y++) {
+        uint16_t last_value = 0;
+        for (size_t x = 0; x < width; x++) {
+            size_t i = y * width + x;
+            uint16_t value = input[2 * i] | input[2 * i + 1] << 8;
+            uint16_t sample = difference && x > 0 ? value - last_value : value;
+            high[i] = sample >> 8;
+            low[i] = sample & 0xFF;
+            last_value = value;
+        }
+    }
+}
+
+// Reverse split_planes and append the 16-bit samples to output
+void merge_planes(const std::vector<uint8_t>& high, const std::vector<uint8_t>& low, size_t width, bool difference,
+                  std::vector<uint8_t>& output) {
+    size_t start = output.size();
+    output.resize(start + 2 * high.size());
+    uint8_t* samples = output.data() + start;
+    for (size_t i = 0; i < high.size(); i++) {
+        uint16_t value = high[i] << 8 | low[i];
+        if (difference && i % width != 0) {
+            value += samples[2 * i - 2] | samples[2 * i - 1] << 8;
+        }
+        samples[2 * i] = value & 0xFF;
+        samples[2 * i + 1] = value >> 8;
+    }
+}
+
+// Copy every channel of interleaved pixels to its own plane
+// pixel_count: number of pixels of the input
+// sample_size: size of a sample of a channel in bytes
+// The loops over a single channel are plain strided copies, which
+// the compiler turns into shuffles
+void deinterleave_planes(const uint8_t* input, size_t pixel_count, size_t channels, size_t sample_size,
+                         std::vector<uint8_t>* planes) {
+    size_t pixel_size = channels * sample_size;
+    for (size_t c = 0; c < channels; c++) {
+        planes[c].resize(pixel_count * sample_size);
+        uint8_t* plane = planes[c].data();
+        const uint8_t* channel = input + c * sample_size;
+        if (sample_size == 1) {
+            for (size_t i = 0; i < pixel_count; i++) {
+                plane[i] = channel[i * pixel_size];
+            }
+        } else {
+            for (size_t i = 0; i < pixel_count; i++) {
+                memcpy(plane + i * sample_size, channel + i * pixel_size, sample_size);
+            }
+        }
+    }
+}
+
+// Reverse deinterleave_planes and append the interleaved pixels to output
+void interleave_planes(const std::vector<uint8_t>* planes, size_t channels, size_t sample_size, std::vector<uint8_t>& output) {
+    size_t pixel_count = planes[0].size() / sample_size;
+    size_t pixel_size = channels * sample_size;
+    size_t start = output.size();
+    output.resize(start + pixel_count * pixel_size);
+    for (size_t c = 0; c < channels; c++) {
+        const uint8_t* plane = planes[c].data();
+        uint8_t* channel = output.data() + start + c * sample_size;
+        if (sample_size == 1) {
+            for (size_t i = 0; i < pixel_count; i++) {
+                channel[i * pixel_size] = plane[i];
+            }
+        } else {
+            for (size_t i = 0; i < pixel_count; i++) {
+                memcpy(channel + i * pixel_size, plane + i * sample_size, sample_size);
+            }
+        }
+    }
+}
+
+// Split a color filter array mosaic into the half-resolution planes of its
+// 2x2 filter pattern, in the order top left, top right, bottom left, bottom right
+// height: number of rows of the mosaic, which must be even
+// sample_size: size of a sample in bytes
+void split_mosaic(const uint8_t* input, size_t width, size_t height, size_t sample_size, std::vector<uint8_t>* planes) {
+    size_t plane_row = width / 2 * sample_size;
+    for (size_t i = 0; i < CFA_PLANES; i++) {
+        planes[i].resize(plane_row * (height / 2));
+    }
+    for (size_t y = 0; y < height; y++) {
+        const uint8_t* row = input + y * width * sample_size;
+        uint8_t* even = planes[(y % 2) * 2].data() + (y / 2) * plane_row;
+        uint8_t* odd = planes[(y % 2) * 2 + 1].data() + (y / 2) * plane_row;
+        for (size_t x = 0; x < width / 2; x++) {
+            memcpy(even + x * sample_size, row + 2 * x * sample_size, sample_size);
+            memcpy(odd + x * sample_size, row + (2 * x + 1) * sample_size, sample_size);
+        }
+    }
+}
+
+// Reverse split_mosaic and append the mosaic to output
+void merge_mosaic(const std::vector<uint8_t>* planes, size_t width, size_t sample_size, std::vector<uint8_t>& output) {
+    size_t plane_row = width / 2 * sample_size;
+    size_t height = planes[0].size() / plane_row * 2;
+    size_t start = output.size();
+    output.resize(start + height * width * sample_size);
+    for (size_t y = 0; y < height; y++) {
+        uint8_t* row = output.data() + start + y * width * sample_size;
+        const uint8_t* even = planes[(y % 2) * 2].data() + (y / 2) * plane_row;
+        const uint8_t* odd = planes[(y % 2) * 2 + 1].data() + (y / 2) * plane_row;
+        for (size_t x = 0; x < width / 2; x++) {
+            memcpy(row + 2 * x * sample_size, even + x * sample_size, sample_size);
+            memcpy(row + (2 * x + 1) * sample_size, odd + x * sample_size, sample_size);
+        }
+    }
+}
+
+// Replace the R, G and B planes with the Y, Co and Cg planes of the
+// YCoCg-R transform, every lifting step is taken modulo 256 and reads
+// the chroma as signed bytes, so the transform stays reversible in 8 bits
+void apply_color_transform(std::vector<uint8_t>* planes) {
+    uint8_t* r = planes[0].data();
+    uint8_t* g = planes[1].data();
+    uint8_t* b = planes[2].data();
+    for (size_t i = 0; i < planes[0].size(); i++) {
+        uint8_t co = r[i] - b[i];
+        uint8_t t = b[i] + ((int8_t)co >> 1);
+        uint8_t cg = g[i] - t;
+        r[i] = t + ((int8_t)cg >> 1);
+        g[i] = co;
+        b[i] = cg;
+    }
+}
+
+// Reverse apply_color_transform
+void remove_color_transform(std::vector<uint8_t>* planes) {
+    uint8_t* y = planes[0].data();
+    uint8_t* co = planes[1].data();
+    uint8_t* cg = planes[2].data();
+    for (size_t i = 0; i < planes[0].size(); i++) {
+        uint8_t t = y[i] - ((int8_t)cg[i] >> 1);
+        uint8_t g = cg[i] + t;
+        uint8_t b = t - ((int8_t)co[i] >> 1);
+        y[i] = b + co[i];
+        co[i] = g;
+        cg[i] = b;
+    }
+}
+
+// Number of bits of a palette index
+unsigned palette_bits(size_t palette_size) {
+    return palette_size <= 2 ? 1 : palette_size <= 4 ? 2 : 4;
+}
+
+// Collect the palette of the image, empty if it has too many distinct values
+std::vector<uint8_t> find_palette(const uint8_t* buffer, size_t size) {
+    bool used[256] = {false};
+    for (size_t i = 0; i < size; i++) {
+        used[buffer[i]] = true;
+    }
+    std::vector<uint8_t> palette;
+    for (size_t value = 0; value < 256; value++) {
+        if (used[value]) {
+            if (palette.size() == PALETTE_MAX_SIZE) {
+                return std::vector<uint8_t>();
+            }
+            palette.push_back(value);
+        }
+    }
+    return palette;
+}
+
+// Replace the pixels by their packed palette indices, the packed data
+// is size / pixels per byte long and written to the start of the buffer
+void palette_pack(uint8_t* buffer, size_t size, const std::vector<uint8_t>& palette) {
+    uint8_t index_of[256] = {0};
+    for (size_t i = 0; i < palette.size(); i++) {
+        index_of[palette[i]] = i;
+    }
+    unsigned bits = palette_bits(palette.size());
+    size_t pixels_per_byte = 8 / bits;
+    for (size_t i = 0; i < size; i += pixels_per_byte) {
+        uint8_t packed = 0;
+        for (size_t j = 0; j < pixels_per_byte; j++) {
+            packed |= index_of[buffer[i + j]] << (j * bits);
+        }
+        buffer[i / pixels_per_byte] = packed;
+    }
+}
+
+// Unpack palette indices with a table of the pixels every byte value stands for
+void palette_unpack(const uint8_t* packed, size_t size, const std::vector<uint8_t>& palette, std::vector<uint8_t>& output) {
+    unsigned bits = palette_bits(palette.size());
+    size_t pixels_per_byte = 8 / bits;
+    uint8_t table[256][8];
+    for (size_t byte = 0; byte < 256; byte++) {
+        for (size_t j = 0; j < pixels_per_byte; j++) {
+            size_t index = (byte >> (j * bits)) & ((1 << bits) - 1);
+            table[byte][j] = index < palette.size() ? palette[index] : 0;
+        }
+    }
+
+    size_t start = output.size();
+    output.resize(start + size * pixels_per_byte);
+    uint8_t* pixels = output.data() + start;
+    for (size_t i = 0; i < size; i++, pixels += pixels_per_byte) {
+        memcpy(pixels, table[packed[i]], pixels_per_byte);
+    }
+}
+
+// Block positions of the pixels in every scan order, built once
+struct ScanTables {
+    uint16_t positions[SCAN_ORDERS][BLOCK_BYTE_SIZE];
+
+    ScanTables() {
+        for (size_t i = 0; i < BLOCK_BYTE_SIZE; i++) {
+            size_t row = i / BLOCK_SIZE, column = i % BLOCK_SIZE;
+            positions[SCAN_ROWS][i] = i;
+            positions[SCAN_SNAKE][i] = row * BLOCK_SIZE + (row % 2 == 0 ? column : BLOCK_SIZE - 1 - column);
+
+            size_t x = 0, y = 0;
+            for (size_t side = 1, rest = i; side < BLOCK_SIZE; side *= 2, rest /= 4) {
+                size_t rx = (rest / 2) & 1;
+                size_t ry = (rest ^ rx) & 1;
+                if (ry == 0) {
+                    if (rx == 1) {
+                        x = side - 1 - x;
+                        y = side - 1 - y;
+                    }
+                    std::swap(x, y);
+                }
+                x += side * rx;
+                y += side * ry;
+            }
+            positions[SCAN_HILBERT][i] = y * BLOCK_SIZE + x;
+
+            x = y = 0;
+            for (size_t bit = 0; (BLOCK_SIZE >> bit) > 1; bit++) {
+                x |= ((i >> (2 * bit)) & 1) << bit;
+                y |= ((i >> (2 * bit + 1)) & 1) << bit;
+            }
+            positions[SCAN_MORTON][i] = y * BLOCK_SIZE + x;
+        }
+    }
+};
+
+const uint16_t* scan_positions(uint8_t order) {
+    static const ScanTables tables;
+    return tables.positions[order];
+}
+
+// Gather the pixels of a block in the given scan order
+void scan_block(const uint8_t* block, uint8_t order, uint8_t* scanned) {
+    const uint16_t* positions = scan_positions(order);
+    for (size_t i = 0; i < BLOCK_BYTE_SIZE; i++) {
+        scanned[i] = block[positions[i]];
+    }
+}
+
+// Scatter the pixels of a block scanned in the given order back in place
+void unscan_block(uint8_t* buffer, uint8_t order) {
+    const uint16_t* positions = scan_positions(order);
+    uint8_t block[BLOCK_BYTE_SIZE];
+    for (size_t i = 0; i < BLOCK_BYTE_SIZE; i++) {
+        block[positions[i]] = buffer[i];
+    }
+    memcpy(buffer, block, BLOCK_BYTE_SIZE);
+}
+
+void transpose_block(uint8_t* buffer, size_t side) {
+    for (size_t i = 0; i < side; i++) {
+        for (size_t j = i + 1; j < side; j++) {
+            std::swap(buffer[i * side + j], buffer[j * side + i]);
+        }
+    }
+}
+
+// Hash of the pixels of a block, used to find repeated blocks
+// The pixels are mixed 8 bytes at a time, size must be a multiple of 8
+uint64_t block_hash(const uint8_t* block, size_t size) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word;
+        memcpy(&word, block + i, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Append a block header with the given flag byte and compressed size
+void put_block_header(std::vector<uint8_t>& output, uint8_t flags, size_t compressed_size) {
+    output.push_back(flags);
+    output.push_back(compressed_size & 0xFF);
+    output.push_back((compressed_size >> 8) & 0xFF);
+    output.push_back((compressed_size >> 16) & 0xFF);
+    output.push_back((compressed_size >> 24) & 0xFF);
+}
+
+// Index of the block at (x, y) as stored in COPY blocks
+size_t copy_index(const Header& header, size_t x, size_t y) {
+    size_t unit = header.quadtree ? QUADTREE_MIN_SIZE : BLOCK_SIZE;
+    return (y / unit) * (header.width / unit) + x / unit;
+}
+
+// Append a COPY block if the block of side x side pixels at (x, y) of the image
+// repeats an earlier block of the same side, remember the block otherwise
+// The hashes only point at candidates, which are compared in full, constant
+// blocks are cheaper on their own and never copied
+// earlier_blocks: map from the hashes of the earlier blocks to their indices
+// Returns true if the COPY block was appended
+bool put_copy_block(const uint8_t* block, size_t side, const Header& header, const uint8_t* image, size_t x, size_t y,
+                    std::unordered_map<uint64_t, size_t>& earlier_blocks, std::vector<uint8_t>& output, CompressStats* stats) {
+    uint8_t min_value, max_value;
+    block_range(block, side * side, min_value, max_value);
+    if (max_value - min_value <= 2 * header.near) {
+        return false;
+    }
+
+    size_t unit = header.quadtree ? QUADTREE_MIN_SIZE : BLOCK_SIZE;
+    size_t index = copy_index(header, x, y);
+    auto earlier = earlier_blocks.emplace(block_hash(block, side * side) ^ side, index).first;
+    size_t earlier_x = (earlier->second % (header.width / unit)) * unit;
+    size_t earlier_y = (earlier->second / (header.width / unit)) * unit;
+    bool same = earlier->second != index;
+    for (size_t by = 0; same && by < side; by++) {
+        same = memcmp(block + by * side, image + (earlier_y + by) * header.width + earlier_x, side) == 0;
+    }
+    if (!same) {
+        return false;
+    }
+
+    stats->blocks++;
+    stats->duplicate_blocks++;
+    put_block_header(output, BLOCK_MODE_COPY << BLOCK_MODE_SHIFT, BLOCK_COPY_SIZE);
+    for (int shift = 0; shift < 32; shift += 8) {
+        output.push_back((earlier->second >> shift) & 0xFF);
+    }
+    return true;
+}
+
+// Position of the QUADTREE_MIN_SIZE cell at (x, y) in the coding order of quadtree
+// mode, superblocks row by row and the cells of a superblock in Z-order, which is
+// the preorder of the quarters
+size_t quadtree_order(const Header& header, size_t x, size_t y) {
+    size_t superblock = (y / SUPERBLOCK_SIZE) * (header.width / SUPERBLOCK_SIZE) + x / SUPERBLOCK_SIZE;
+    size_t cell_x = x % SUPERBLOCK_SIZE / QUADTREE_MIN_SIZE;
+    size_t cell_y = y % SUPERBLOCK_SIZE / QUADTREE_MIN_SIZE;
+    size_t morton = 0;
+    for (size_t bit = 0; (SUPERBLOCK_CELLS >> bit) > 1; bit++) {
+        morton |= ((cell_x >> bit) & 1) << (2 * bit) | ((cell_y >> bit) & 1) << (2 * bit + 1);
+    }
+    return superblock * SUPERBLOCK_CELLS * SUPERBLOCK_CELLS + morton;
+}
+
+// LZSS options of a block at (x, y) of the image coded in the given scan, with
+// the history made of the preset dictionary followed by the primer, cut to the window
+// The primer is the end of the neighbouring block coded in the same scan, which is
+// the block above for the row scan and the curves and the block to the left for
+// the transposed scan, so it continues right where the block starts
+// Only blocks above and to the left are used, the blocks of an anti-diagonal
+// wavefront never depend on each other
+// history: storage for the history, there is no primer when priming is off,
+// image is nullptr or the block lies at the image border
+LzssOptions block_lzss_options(const Header& header, const uint8_t* image, size_t x, size_t y, uint8_t order, bool horizontal,
+                               std::vector<uint8_t>& history) {
+    LzssOptions lzss = header.lzss;
+    history.assign(header.dictionary.end() - std::min(header.dictionary.size(), lzss.window_size), header.dictionary.end());
+
+    bool above = order != SCAN_ROWS || horizontal;
+    if (header.prime && image != nullptr && (above ? y : x) != 0) {
+        size_t neighbour_x = above ? x : x - BLOCK_SIZE;
+        size_t neighbour_y = above ? y - BLOCK_SIZE : y;
+        uint8_t neighbour[BLOCK_BYTE_SIZE];
+        for (size_t by = 0; by < BLOCK_SIZE; by++) {
+            memcpy(neighbour + by * BLOCK_SIZE, image + (neighbour_y + by) * header.width + neighbour_x, BLOCK_SIZE);
+        }
+        if (order != SCAN_ROWS) {
+            uint8_t scanned[BLOCK_BYTE_SIZE];
+            scan_block(neighbour, order, scanned);
+            memcpy(neighbour, scanned, BLOCK_BYTE_SIZE);
+        } else if (!horizontal) {
+            transpose_block(neighbour, BLOCK_SIZE);
+        }
+
+        size_t block_bytes = BLOCK_BYTE_SIZE;
+        if (!header.palette.empty()) {
+            palette_pack(neighbour, BLOCK_BYTE_SIZE, header.palette);
+            block_bytes /= 8 / palette_bits(header.palette.size());
+        }
+        if (header.model == MODEL_DIFFERENCE) {
+            apply_difference(neighbour, BLOCK_SIZE, BLOCK_SIZE, header.near);
+        } else if (header.model == MODEL_WAVELET) {
+            apply_wavelet(neighbour, BLOCK_SIZE, BLOCK_SIZE);
+        }
+
+        size_t primer_size = std::min(block_bytes, lzss.window_size);
+        history.insert(history.end(), neighbour + block_bytes - primer_size, neighbour + block_bytes);
+        if (history.size() > lzss.window_size) {
+            history.erase(history.begin(), history.end() - lzss.window_size);
+        }
+    }
+
+    lzss.history = history.data();
+    lzss.history_size = history.size();
+    return lzss;
+}
+
+// Compress an adaptive block of side x side pixels, stored row by row, and append
+// it with its block header, the scan giving the smallest output is kept
+// image: the whole image with the block at (x, y) for priming, nullptr if unused
+// The block is modified
+void compress_block(uint8_t* horizontal_block, size_t side, const Header& header, const CompressOptions& options,
+                    const uint8_t* image, size_t x, size_t y, std::vector<uint8_t>& output, CompressStats* stats) {
+    size_t block_size = side * side;
+    size_t pixels_per_byte = header.palette.empty() ? 1 : 8 / palette_bits(header.palette.size());
+    size_t block_bytes = block_size / pixels_per_byte;
+    uint8_t model = header.model;
+
+    // Constant blocks are stored as their value without trying to compress them,
+    // in near-lossless mode so are the blocks within the error bound of a value
+    uint8_t min_value, max_value;
+    block_range(horizontal_block, block_size, min_value, max_value);
+    stats->blocks++;
+    if (max_value - min_value <= 2 * header.near) {
+        stats->constant_blocks++;
+        put_block_header(output, (min_value == max_value ? BLOCK_MODE_CONSTANT : BLOCK_MODE_NEAR_CONSTANT) << BLOCK_MODE_SHIFT, 1);
+        output.push_back((min_value + max_value) / 2);
+        return;
+    }
+
+    std::vector<uint8_t> horizontal_output;
+    horizontal_output.reserve(block_size);
+
+    // The context model works in two dimensions, the block is only coded once
+    if (model == MODEL_CONTEXT) {
+        size_t compressed_size = context_compress(horizontal_block, side, side, horizontal_output);
+        if (compressed_size >= block_size) {
+            compressed_size = block_size;
+            horizontal_output.assign(horizontal_block, horizontal_block + block_size);
+        }
+        stats->raw_blocks += compressed_size == block_size;
+        put_block_header(output, compressed_size < block_size ? 0x03 : 0x02, compressed_size);
+        output.insert(output.end(), horizontal_output.begin(), horizontal_output.end());
+        return;
+    }
+
+    // The space-filling curves are tried first, while the block is untouched,
+    // their position tables only cover the default block size
+    size_t curve_size = block_bytes;
+    uint8_t curve_order = SCAN_ROWS, curve_mode = BLOCK_MODE_CODED;
+    std::vector<uint8_t> curve_output, trial_output, primer;
+    for (uint8_t order = SCAN_SNAKE; options.scan_curves && side == BLOCK_SIZE && order <= SCAN_MORTON; order++) {
+        uint8_t curve_block[BLOCK_BYTE_SIZE];
+        scan_block(horizontal_block, order, curve_block);
+        if (!header.palette.empty()) {
+            palette_pack(curve_block, BLOCK_BYTE_SIZE, header.palette);
+        }
+        if (model == MODEL_DIFFERENCE) {
+            apply_difference(curve_block, BLOCK_SIZE, BLOCK_SIZE, header.near);
+        } else if (model == MODEL_WAVELET) {
+            apply_wavelet(curve_block, BLOCK_SIZE, BLOCK_SIZE);
+        }
+        uint8_t mode;
+        LzssOptions lzss = block_lzss_options(header, image, x, y, order, true, primer);
+        size_t size = compress_stream(curve_block, block_bytes, trial_output, lzss, header.rle, options.bitpack, mode, stats);
+        if (size < curve_size) {
+            curve_size = size;
+            curve_order = order;
+            curve_mode = mode;
+            curve_output.swap(trial_output);
+        }
+        trial_output.clear();
+    }
+
+    uint8_t vertical_block[SUPERBLOCK_BYTE_SIZE];
+    memcpy(vertical_block, horizontal_block, block_size);
+    transpose_block(vertical_block, side);
+    if (!header.palette.empty()) {
+        palette_pack(horizontal_block, block_size, header.palette);
+        palette_pack(vertical_block, block_size, header.palette);
+    }
+
+    if (model == MODEL_DIFFERENCE) {
+        apply_difference(horizontal_block, side, side, header.near);
+        apply_difference(vertical_block, side, side, header.near);
+    } else if (model == MODEL_WAVELET) {
+        apply_wavelet(horizontal_block, side, side);
+        apply_wavelet(vertical_block, side, side);
+    }
+
+    // When all trials fail the block is stored raw
+    std::vector<uint8_t> vertical_output;
+    vertical_output.reserve(block_size);
+    uint8_t horizontal_mode, vertical_mode;
+    LzssOptions lzss = block_lzss_options(header, image, x, y, SCAN_ROWS, true, primer);
+    size_t horizontal_size = compress_stream(horizontal_block, block_bytes, horizontal_output, lzss, header.rle,
+                                             options.bitpack, horizontal_mode, stats);
+    lzss = block_lzss_options(header, image, x, y, SCAN_ROWS, false, primer);
+    size_t vertical_size = compress_stream(vertical_block, block_bytes, vertical_output, lzss, header.rle,
+                                           options.bitpack, vertical_mode, stats);
+
+    size_t compressed_size = std::min({horizontal_size, vertical_size, curve_size});
+    if (curve_size < std::min(horizontal_size, vertical_size)) {
+        put_block_header(output, 0x03 | curve_order << SCAN_ORDER_SHIFT | curve_mode << BLOCK_MODE_SHIFT, compressed_size);
+        stats->packed_blocks += curve_mode == BLOCK_MODE_PACKED;
+        stats->curve_blocks++;
+        output.insert(output.end(), curve_output.begin(), curve_output.begin() + curve_size);
+    } else if (horizontal_size < vertical_size) {
+        put_block_header(output, 0x03 | horizontal_mode << BLOCK_MODE_SHIFT, compressed_size);
+        stats->packed_blocks += horizontal_mode == BLOCK_MODE_PACKED;
+        output.insert(output.end(), horizontal_output.begin(), horizontal_output.begin() + horizontal_size);
+    } else if (vertical_size != block_bytes) {
+        put_block_header(output, 0x01 | vertical_mode << BLOCK_MODE_SHIFT, compressed_size);
+        stats->packed_blocks += vertical_mode == BLOCK_MODE_PACKED;
+        output.insert(output.end(), vertical_output.begin(), vertical_output.begin() + vertical_size);
+    } else {
+        stats->raw_blocks++;
+        put_block_header(output, 0x02, compressed_size);
+        output.insert(output.end(), horizontal_block, horizontal_block + block_bytes);
+    }
+}
+
+// Gradient sums of the QUADTREE_MIN_SIZE cells of a superblock, along the rows
+// and along the columns, a cheap estimate of how well each scan direction codes
+struct CellGradients {
+    size_t horizontal[SUPERBLOCK_CELLS][SUPERBLOCK_CELLS];
+    size_t vertical[SUPERBLOCK_CELLS][SUPERBLOCK_CELLS];
+
+    CellGradients(const uint8_t* superblock) {
+        for (size_t cy = 0; cy < SUPERBLOCK_CELLS; cy++) {
+            for (size_t cx = 0; cx < SUPERBLOCK_CELLS; cx++) {
+                size_t h = 0, v = 0;
+                for (size_t y = cy * QUADTREE_MIN_SIZE; y < (cy + 1) * QUADTREE_MIN_SIZE; y++) {
+                    const uint8_t* row = superblock + y * SUPERBLOCK_SIZE;
+                    for (size_t x = cx * QUADTREE_MIN_SIZE; x < (cx + 1) * QUADTREE_MIN_SIZE; x++) {
+                        h += x > 0 ? std::abs(row[x] - row[x - 1]) : 0;
+                        v += y > 0 ? std::abs(row[x] - row[x - SUPERBLOCK_SIZE]) : 0;
+                    }
                 }
-                memcpy(vertical_block, horizontal_block, BLOCK_BYTE_SIZE);
-                transpose_block(vertical_block);
+                horizontal[cy][cx] = h;
+                vertical[cy][cx] = v;
+            }
+        }
+    }
+
+    // Estimated cost of coding the square of cells at (x, y) of the given side
+    // in pixels, the better scan direction of the square is used
+    size_t cost(size_t x, size_t y, size_t side) const {
+        size_t h = 0, v = 0;
+        for (size_t cy = y / QUADTREE_MIN_SIZE; cy < (y + side) / QUADTREE_MIN_SIZE; cy++) {
+            for (size_t cx = x / QUADTREE_MIN_SIZE; cx < (x + side) / QUADTREE_MIN_SIZE; cx++) {
+                h += horizontal[cy][cx];
+                v += vertical[cy][cx];
+            }
+        }
+        return std::min(h, v);
+    }
+};
 
-                if (model) {
-                    apply_difference(horizontal_block, BLOCK_SIZE, BLOCK_SIZE);
-                    apply_difference(vertical_block, BLOCK_SIZE, BLOCK_SIZE);
+// Decide the splits of the quadtree node at (x, y) of the image and compress
+// its blocks, the split bits are appended to tree in preorder
+// gradients: gradients of the superblock the node lies in
+// earlier_blocks: hashes of the earlier blocks, as for put_copy_block
+// A node is split when its quarters together gain enough from choosing their scan
+// directions on their own, superblocks also when they are too busy for long matches
+// The gradients say little about nodes that repeat themselves, where at least one
+// in QUADTREE_MATCH_RATIO positions repeats an earlier one, such nodes are coded
+// both whole and split and the smaller output is kept
+void compress_node(const uint8_t* image, const CellGradients& gradients, size_t x, size_t y, size_t side,
+                   const Header& header, const CompressOptions& options, std::unordered_map<uint64_t, size_t>& earlier_blocks,
+                   uint32_t& tree, size_t& tree_bits, std::vector<uint8_t>& output, CompressStats* stats) {
+    uint8_t block[SUPERBLOCK_BYTE_SIZE];
+    for (size_t by = 0; by < side; by++) {
+        memcpy(block + by * side, image + (y + by) * header.width + x, side);
+    }
+    size_t half = side / 2;
+    auto compress_quarters = [&](uint32_t& quarter_tree, size_t& quarter_bits, std::vector<uint8_t>& quarter_output,
+                                 CompressStats* quarter_stats) {
+        for (size_t quarter = 0; quarter < 4; quarter++) {
+            compress_node(image, gradients, x + (quarter % 2) * half, y + (quarter / 2) * half, half, header, options,
+                          earlier_blocks, quarter_tree, quarter_bits, quarter_output, quarter_stats);
+        }
+    };
+
+    if (side > QUADTREE_MIN_SIZE && repeat_hits(nullptr, 0, block, side * side, header.lzss.window_size) * QUADTREE_MATCH_RATIO >= side * side) {
+        std::vector<uint8_t> whole_output, split_output;
+        CompressStats whole_stats = *stats, split_stats = *stats;
+        if (!put_copy_block(block, side, header, image, x, y, earlier_blocks, whole_output, &whole_stats)) {
+            compress_block(block, side, header, options, nullptr, 0, 0, whole_output, &whole_stats);
+        }
+        uint32_t split_tree = tree | (uint32_t)1 << tree_bits;
+        size_t split_bits = tree_bits + 1;
+        compress_quarters(split_tree, split_bits, split_output, &split_stats);
+
+        if (split_output.size() < whole_output.size()) {
+            tree = split_tree;
+            tree_bits = split_bits;
+            *stats = split_stats;
+            output.insert(output.end(), split_output.begin(), split_output.end());
+        } else {
+            tree_bits++;
+            *stats = whole_stats;
+            output.insert(output.end(), whole_output.begin(), whole_output.end());
+        }
+        return;
+    }
+
+    if (side > QUADTREE_MIN_SIZE) {
+        size_t cell_x = x % SUPERBLOCK_SIZE, cell_y = y % SUPERBLOCK_SIZE;
+        size_t cost = gradients.cost(cell_x, cell_y, side);
+        size_t split_cost = gradients.cost(cell_x, cell_y, half) + gradients.cost(cell_x + half, cell_y, half)
+            + gradients.cost(cell_x, cell_y + half, half) + gradients.cost(cell_x + half, cell_y + half, half);
+        bool split = split_cost * QUADTREE_SPLIT_GAIN < cost * (QUADTREE_SPLIT_GAIN - 1)
+            || (side == SUPERBLOCK_SIZE && cost > side * side * QUADTREE_BUSY_GRADIENT);
+        tree |= (uint32_t)split << tree_bits++;
+        if (split) {
+            compress_quarters(tree, tree_bits, output, stats);
+            return;
+        }
+    }
+    if (!put_copy_block(block, side, header, image, x, y, earlier_blocks, output, stats)) {
+        compress_block(block, side, header, options, nullptr, 0, 0, output, stats);
+    }
+}
+
+// Compress the blocks of a single image or frame of a sequence in the fixed
+// adaptive grid
+// previous: the previous frame of the sequence, nullptr for the first frame
+// Blocks repeating an earlier one of the frame are stored as its index
+// Blocks of later frames are also coded as their difference from the previous
+// frame, which is kept when it is smaller than the block on its own
+void compress_frame(const uint8_t* image, const uint8_t* previous, size_t width, size_t height, const Header& header,
+                    const CompressOptions& options, std::vector<uint8_t>& output, CompressStats* stats) {
+    uint8_t block[BLOCK_BYTE_SIZE];
+    std::unordered_map<uint64_t, size_t> earlier_blocks;
+    std::vector<uint8_t> inter_output, intra_output;
+    for (size_t y = 0; y < height; y += BLOCK_SIZE) {
+        for (size_t x = 0; x < width; x += BLOCK_SIZE) {
+            for (size_t by = 0; by < BLOCK_SIZE; by++) {
+                memcpy(
+                    block + by * BLOCK_SIZE,
+                    image + (y + by) * width + x,
+                    std::min((size_t)BLOCK_SIZE, width - x)
+                );
+            }
+
+            uint8_t residual[BLOCK_BYTE_SIZE];
+            bool unchanged = previous != nullptr;
+            for (size_t by = 0; previous != nullptr && by < BLOCK_SIZE; by++) {
+                const uint8_t* reference = previous + (y + by) * width + x;
+                for (size_t bx = 0; bx < BLOCK_SIZE; bx++) {
+                    residual[by * BLOCK_SIZE + bx] = block[by * BLOCK_SIZE + bx] - reference[bx];
+                    unchanged &= residual[by * BLOCK_SIZE + bx] == 0;
                 }
+            }
+            if (unchanged) {
+                stats->blocks++;
+                stats->unchanged_blocks++;
+                put_block_header(output, BLOCK_MODE_UNCHANGED << BLOCK_MODE_SHIFT, 0);
+                continue;
+            }
+
+            if (put_copy_block(block, BLOCK_SIZE, header, image, x, y, earlier_blocks, output, stats)) {
+                continue;
+            } else if (previous == nullptr) {
+                compress_block(block, BLOCK_SIZE, header, options, image, x, y, output, stats);
+                continue;
+            }
+
+            // The counters of the block on its own only count when it is kept
+            uint8_t mode;
+            inter_output.clear();
+            intra_output.clear();
+            size_t inter_size = compress_stream(residual, BLOCK_BYTE_SIZE, inter_output, header.lzss, header.rle, false, mode, stats);
+            CompressStats intra_stats = *stats;
+            if (inter_size * INTER_GOOD_RATIO >= BLOCK_BYTE_SIZE) {
+                compress_block(block, BLOCK_SIZE, header, options, image, x, y, intra_output, &intra_stats);
+            }
+            if (!intra_output.empty() && inter_size + BLOCK_HEADER_SIZE >= intra_output.size()) {
+                *stats = intra_stats;
+                output.insert(output.end(), intra_output.begin(), intra_output.end());
+                continue;
+            }
+            stats->blocks++;
+            stats->inter_blocks++;
+            put_block_header(output, (inter_size < BLOCK_BYTE_SIZE ? 0x03 : 0x02) | BLOCK_MODE_INTER << BLOCK_MODE_SHIFT, inter_size);
+            if (inter_size < BLOCK_BYTE_SIZE) {
+                output.insert(output.end(), inter_output.begin(), inter_output.begin() + inter_size);
+            } else {
+                output.insert(output.end(), residual, residual + BLOCK_BYTE_SIZE);
+            }
+        }
+    }
+}
+
+// Add the counters of part to total
+void add_stats(CompressStats& total, const CompressStats& part) {
+    total.blocks += part.blocks;
+    total.constant_blocks += part.constant_blocks;
+    total.raw_blocks += part.raw_blocks;
+    total.packed_blocks += part.packed_blocks;
+    total.duplicate_blocks += part.duplicate_blocks;
+    total.unchanged_blocks += part.unchanged_blocks;
+    total.inter_blocks += part.inter_blocks;
+    total.curve_blocks += part.curve_blocks;
+    total.skipped_trials += part.skipped_trials;
+    total.skipped_bytes += part.skipped_bytes;
+}
+
+// Number of blocks using the scan order or block mode bits of the flag byte
+size_t extended_blocks(const CompressStats& stats) {
+    return stats.constant_blocks + stats.packed_blocks + stats.duplicate_blocks + stats.unchanged_blocks
+        + stats.inter_blocks + stats.curve_blocks;
+}
+
+// Compress every plane as a complete image on its own thread and append
+// them in order, each with its 4-byte little-endian size
+void compress_planes(std::vector<uint8_t>* planes, size_t count, size_t width, const CompressOptions& options,
+                     std::vector<uint8_t>& output, CompressStats* stats) {
+    std::vector<uint8_t> plane_outputs[MAX_CHANNELS];
+    CompressStats plane_stats[MAX_CHANNELS];
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < count; i++) {
+        threads.emplace_back([&, i]() {
+            compress(planes[i].data(), planes[i].size(), width, options, plane_outputs[i], &plane_stats[i]);
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            output.push_back((plane_outputs[i].size() >> shift) & 0xFF);
+        }
+        output.insert(output.end(), plane_outputs[i].begin(), plane_outputs[i].end());
+        add_stats(*stats, plane_stats[i]);
+    }
+}
+
+size_t compress(uint8_t* input, size_t input_size, size_t width, const CompressOptions& options, std::vector<uint8_t>& output,
+                CompressStats* stats) {
+    CompressStats unused_stats;
+    if (stats == nullptr) {
+        stats = &unused_stats;
+    }
+    uint8_t model = options.model;
+
+    if (options.channels > 1) {
+        Header header;
+        header.width = width;
+        header.bits = options.bits;
+        header.channels = options.channels;
+        header.model = model;
+        header.near = options.near;
+        header.color_transform = options.color_transform && options.channels >= 3 && options.bits == 8;
+        write_header(header, output);
+
+        std::vector<uint8_t> planes[MAX_CHANNELS];
+        size_t sample_size = options.bits / 8;
+        deinterleave_planes(input, input_size / (options.channels * sample_size), options.channels, sample_size, planes);
+        if (header.color_transform) {
+            apply_color_transform(planes);
+        }
+        CompressOptions plane_options = options;
+        plane_options.channels = 1;
+        compress_planes(planes, options.channels, width, plane_options, output, stats);
+        return output.size();
+    }
+
+    // Neighbouring pixels of a mosaic lie under different filters, the models
+    // only see pixels of the same filter in the planes
+    if (options.cfa) {
+        Header header;
+        header.width = width;
+        header.bits = options.bits;
+        header.cfa = true;
+        write_header(header, output);
+
+        std::vector<uint8_t> planes[CFA_PLANES];
+        size_t sample_size = options.bits / 8;
+        split_mosaic(input, width, input_size / sample_size / width, sample_size, planes);
+        CompressOptions plane_options = options;
+        plane_options.cfa = false;
+        compress_planes(planes, CFA_PLANES, width / 2, plane_options, output, stats);
+        return output.size();
+    }
+
+    // The byte planes of 16-bit images are compressed as 8-bit images on their own,
+    // the differences they take after the 16-bit prediction are not differenced again,
+    // the adaptive mode only chooses the scan order of the differences per block
+    if (options.bits == 16) {
+        Header header;
+        header.width = width;
+        header.model = model;
+        header.bits = 16;
+        write_header(header, output);
 
-                size_t horizontal_size = lzss_compress(horizontal_block, BLOCK_BYTE_SIZE, horizontal_output);
-                size_t vertical_size = lzss_compress(vertical_block, BLOCK_BYTE_SIZE, vertical_output);
-                
-                size_t compressed_size = std::min(horizontal_size, vertical_size);
-                output.push_back(compressed_size & 0xFF);
-                output.push_back((compressed_size >> 8) & 0xFF);
-                output.push_back((compressed_size >> 16) & 0xFF);
-                output.push_back((compressed_size >> 24) & 0xFF);
-
-                if (horizontal_size < vertical_size) {
-                    output[output.size() - 5] = 0x03;
-                    output.insert(output.end(), horizontal_output.begin(), horizontal_output.begin() + horizontal_size);
-                } else if (vertical_size != BLOCK_BYTE_SIZE) {
-                    output[output.size() - 5] = 0x01;
-                    output.insert(output.end(), vertical_output.begin(), vertical_output.begin() + vertical_size);
-                } else {
-                    output[output.size() - 5] = 0x02;
-                    output.insert(output.end(), horizontal_block, horizontal_block + BLOCK_BYTE_SIZE);
+        std::vector<uint8_t> planes[2];
+        split_planes(input, width, input_size / 2 / width, model == MODEL_DIFFERENCE, planes[0], planes[1]);
+        CompressOptions plane_options = options;
+        plane_options.bits = 8;
+        plane_options.model = model == MODEL_DIFFERENCE ? MODEL_NONE : model;
+        compress_planes(planes, 2, width, plane_options, output, stats);
+        return output.size();
+    }
+
+    Header header;
+    header.frames = options.adaptive && options.near == 0 ? std::max(options.frames, (size_t)1) : 1;
+    size_t height = input_size / width / header.frames;
+
+    header.width = width;
+    header.model = model;
+    header.quadtree = options.adaptive && options.quadtree && header.frames == 1 && height % SUPERBLOCK_SIZE == 0;
+    size_t block_size = header.quadtree ? SUPERBLOCK_SIZE : BLOCK_SIZE;
+    header.block_count = options.adaptive ? (width / block_size) * (height / block_size) : 1;
+    header.lzss.format = options.format;
+    header.lzss.window_size = options.window_size;
+    header.lzss.entropy = options.entropy;
+    header.near = options.near;
+    header.rle = options.rle && options.model != MODEL_CONTEXT;
+    if (!options.dictionary.empty() && options.model != MODEL_CONTEXT) {
+        header.dictionary = options.dictionary;
+        header.dictionary_id = dictionary_id(options.dictionary);
+    }
+    header.prime = options.prime && options.adaptive && !header.quadtree && !header.rle && options.near == 0
+        && options.model != MODEL_CONTEXT;
+
+    // A palette replaces the model, the indices are not worth differencing
+    if (options.palette && model != MODEL_CONTEXT && options.near == 0) {
+        header.palette = find_palette(input, input_size);
+        if (!header.palette.empty()) {
+            model = header.model = MODEL_NONE;
+        }
+    }
+    size_t pixels_per_byte = header.palette.empty() ? 1 : 8 / palette_bits(header.palette.size());
+
+    // The header is inserted once the blocks are known, so that streams
+    // without any newer blocks keep the base version
+    output.reserve(input_size / 2);
+    size_t header_pos = output.size();
+    size_t extended_before = extended_blocks(*stats);
+
+    if (header.quadtree) {
+        // Every superblock starts with its split tree, followed by its blocks in preorder
+        std::vector<uint8_t> superblock(SUPERBLOCK_BYTE_SIZE);
+        std::unordered_map<uint64_t, size_t> earlier_blocks;
+        for (size_t y = 0; y < height; y += SUPERBLOCK_SIZE) {
+            for (size_t x = 0; x < width; x += SUPERBLOCK_SIZE) {
+                for (size_t by = 0; by < SUPERBLOCK_SIZE; by++) {
+                    memcpy(superblock.data() + by * SUPERBLOCK_SIZE, input + (y + by) * width + x, SUPERBLOCK_SIZE);
                 }
+                CellGradients gradients(superblock.data());
 
-                horizontal_output.clear();
-                vertical_output.clear();
+                size_t tree_pos = output.size();
+                output.insert(output.end(), QUADTREE_TREE_SIZE, 0);
+                uint32_t tree = 0;
+                size_t tree_bits = 0;
+                compress_node(input, gradients, x, y, SUPERBLOCK_SIZE, header, options, earlier_blocks, tree, tree_bits, output, stats);
+                for (size_t i = 0; i < QUADTREE_TREE_SIZE; i++) {
+                    output[tree_pos + i] = (tree >> (8 * i)) & 0xFF;
+                }
             }
         }
+    } else if (options.adaptive) {
+        for (size_t frame = 0; frame < header.frames; frame++) {
+            const uint8_t* image = input + frame * width * height;
+            compress_frame(image, frame > 0 ? image - width * height : nullptr, width, height, header, options, output, stats);
+        }
     } else {
-        if (model) {
-            size_t height = input_size / width;
-            apply_difference(input, width, height);
-        }
-        output.push_back(0); // block count lower [2]
-        output.push_back(1); // block count upper [3]
-        output.push_back(0x03); // scanning direction and been encoded flags [4]
-        output.push_back(0); // placeholder for compressed size [5]
-        output.push_back(0); // placeholder for compressed size [6]
-        output.push_back(0); // placeholder for compressed size [7]
-        output.push_back(0); // placeholder for compressed size [8]
-
-        size_t compressed_size = lzss_compress(input, input_size, output);
-        if (compressed_size == input_size) {
-            output.resize(9);
+        if (model == MODEL_DIFFERENCE) {
+            apply_difference(input, width, height, header.near);
+        } else if (model == MODEL_WAVELET) {
+            apply_wavelet(input, width, height);
+        } else if (!header.palette.empty()) {
+            palette_pack(input, input_size, header.palette);
+            input_size /= pixels_per_byte;
+        }
+        std::vector<uint8_t> history;
+        LzssOptions lzss = block_lzss_options(header, nullptr, 0, 0, SCAN_ROWS, true, history);
+        lzss.stride = options.match_2d ? width / pixels_per_byte : 0;
+
+        size_t block_pos = output.size();
+        output.push_back(0x03); // scanning direction and been encoded flags [+0]
+        output.push_back(0); // placeholder for compressed size [+1]
+        output.push_back(0); // placeholder for compressed size [+2]
+        output.push_back(0); // placeholder for compressed size [+3]
+        output.push_back(0); // placeholder for compressed size [+4]
+
+        size_t compressed_size = input_size;
+        uint8_t block_mode = BLOCK_MODE_CODED;
+        stats->blocks++;
+        if (model == MODEL_CONTEXT) {
+            compressed_size = context_compress(input, width, height, output);
+        } else {
+            compressed_size = compress_stream(input, input_size, output, lzss, header.rle, options.bitpack, block_mode, stats);
+        }
+        if (block_mode == BLOCK_MODE_PACKED) {
+            stats->packed_blocks++;
+            output[block_pos] |= block_mode << BLOCK_MODE_SHIFT;
+        }
+        if (compressed_size >= input_size) {
+            stats->raw_blocks++;
+            compressed_size = input_size;
+            output.resize(block_pos + 5);
             output.insert(output.end(), input, input + input_size);
-            output[4] &= 0xFE; // clear the "been encoded" flag
+            output[block_pos] &= 0xFE; // clear the "been encoded" flag
         }
-        output[5] = compressed_size & 0xFF;
-        output[6] = (compressed_size >> 8) & 0xFF;
-        output[7] = (compressed_size >> 16) & 0xFF;
-        output[8] = (compressed_size >> 24) & 0xFF;
+        output[block_pos + 1] = compressed_size & 0xFF;
+        output[block_pos + 2] = (compressed_size >> 8) & 0xFF;
+        output[block_pos + 3] = (compressed_size >> 16) & 0xFF;
+        output[block_pos + 4] = (compressed_size >> 24) & 0xFF;
     }
 
+    std::vector<uint8_t> header_bytes;
+    header.block_modes = extended_blocks(*stats) != extended_before;
+    write_header(header, header_bytes);
+    output.insert(output.begin() + header_pos, header_bytes.begin(), header_bytes.end());
     return output.size();
 }
 
-size_t decompress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output) {
-    if (input_size < 9) {
-        return 0; // Input must be at least 9 bytes (single block)
+// Decompress a single block and append its pixels to output
+// input: pointer to the block header
+// input_size: size of the input from the block header on
+// width: side of the block in adaptive mode, width of the image otherwise
+// image: the image decoded so far with the block at (x, y) for priming, nullptr if unused
+// previous: the previous frame of a sequence, nullptr for the first frame and single images
+// Returns the size of the block in the input, 0 if the block is invalid
+size_t decompress_block(const uint8_t* input, size_t input_size, const Header& header, size_t width, bool adaptive,
+                        const uint8_t* image, const uint8_t* previous, size_t x, size_t y, std::vector<uint8_t>& output) {
+    if (input_size < BLOCK_HEADER_SIZE) {
+        return 0;
+    }
+    bool horizontal = input[0] & 0x02;
+    bool been_encoded = input[0] & 0x01;
+    uint8_t scan_order = (input[0] >> SCAN_ORDER_SHIFT) & SCAN_ORDER_MASK;
+    uint8_t block_mode = input[0] >> BLOCK_MODE_SHIFT;
+    size_t compressed_size = input[1] | (input[2] << 8) | (input[3] << 16) | ((size_t)input[4] << 24);
+    const uint8_t* data = input + BLOCK_HEADER_SIZE;
+    size_t block_size = width * width;
+    if (compressed_size > input_size - BLOCK_HEADER_SIZE || (!header.block_modes && (input[0] & ~0x03) != 0)) {
+        return 0;
+    }
+
+    if (block_mode == BLOCK_MODE_CONSTANT || block_mode == BLOCK_MODE_NEAR_CONSTANT) {
+        if (!adaptive || compressed_size != 1) {
+            return 0;
+        }
+        output.insert(output.end(), block_size, data[0]);
+        return compressed_size + BLOCK_HEADER_SIZE;
+    } else if (block_mode == BLOCK_MODE_COPY) {
+        size_t unit = header.quadtree ? QUADTREE_MIN_SIZE : BLOCK_SIZE;
+        size_t index = data[0] | data[1] << 8 | data[2] << 16 | (size_t)data[3] << 24;
+        size_t source_x = (index % (header.width / unit)) * unit;
+        size_t source_y = (index / (header.width / unit)) * unit;
+        if (image == nullptr || !adaptive || compressed_size != BLOCK_COPY_SIZE) {
+            return 0;
+        }
+        // Only blocks of the same size coded before the block can be copied
+        if (header.quadtree ? source_x % width != 0 || source_y % width != 0
+                || quadtree_order(header, source_x, source_y) + (width / unit) * (width / unit) > quadtree_order(header, x, y)
+            : width != BLOCK_SIZE || index >= copy_index(header, x, y)
+        ) {
+            return 0;
+        }
+        const uint8_t* source = image + source_y * header.width + source_x;
+        for (size_t by = 0; by < width; by++) {
+            output.insert(output.end(), source + by * header.width, source + by * header.width + width);
+        }
+        return compressed_size + BLOCK_HEADER_SIZE;
+    } else if (block_mode == BLOCK_MODE_UNCHANGED || block_mode == BLOCK_MODE_INTER) {
+        if (previous == nullptr || width != BLOCK_SIZE || (block_mode == BLOCK_MODE_UNCHANGED && compressed_size != 0)) {
+            return 0;
+        }
+        size_t start = output.size();
+        if (block_mode == BLOCK_MODE_UNCHANGED) {
+            output.resize(start + BLOCK_BYTE_SIZE, 0);
+        } else if (been_encoded && header.rle) {
+            std::vector<uint8_t> runs;
+            lzss_decompress(data, compressed_size, runs, header.lzss);
+            if (!rle_decode(runs.data(), runs.size(), output)) {
+                return 0;
+            }
+        } else if (been_encoded) {
+            lzss_decompress(data, compressed_size, output, header.lzss);
+        } else {
+            output.insert(output.end(), data, data + compressed_size);
+        }
+        if (output.size() - start != BLOCK_BYTE_SIZE) {
+            return 0;
+        }
+        for (size_t by = 0; by < BLOCK_SIZE; by++) {
+            const uint8_t* reference = previous + (y + by) * header.width + x;
+            for (size_t bx = 0; bx < BLOCK_SIZE; bx++) {
+                output[start + by * BLOCK_SIZE + bx] += reference[bx];
+            }
+        }
+        return compressed_size + BLOCK_HEADER_SIZE;
+    } else if ((block_mode != BLOCK_MODE_CODED && block_mode != BLOCK_MODE_PACKED)
+               || (scan_order != SCAN_ROWS && (!adaptive || width != BLOCK_SIZE))) {
+        return 0;
+    }
+
+    size_t decompressed_size = compressed_size;
+    if (block_mode == BLOCK_MODE_PACKED) {
+        decompressed_size = bitpack_decode(data, compressed_size, output);
+        if (decompressed_size == 0) {
+            return 0;
+        }
+    } else if (been_encoded && header.model == MODEL_CONTEXT) {
+        decompressed_size = context_decompress(data, compressed_size, width, output);
+    } else if (been_encoded && header.rle) {
+        std::vector<uint8_t> runs, history;
+        size_t start = output.size();
+        LzssOptions lzss = block_lzss_options(header, image, x, y, scan_order, horizontal, history);
+        lzss_decompress(data, compressed_size, runs, lzss);
+        if (!rle_decode(runs.data(), runs.size(), output)) {
+            return 0;
+        }
+        decompressed_size = output.size() - start;
+    } else if (been_encoded) {
+        std::vector<uint8_t> history;
+        LzssOptions lzss = block_lzss_options(header, image, x, y, scan_order, horizontal, history);
+        decompressed_size = lzss_decompress(data, compressed_size, output, lzss);
+    } else {
+        output.insert(output.end(), data, data + compressed_size);
     }
 
-    size_t width = input[0] * 256;
-    bool model = input[1] == 1;
-    size_t block_count = input[3] | (input[2] << 8);
+    if (!header.palette.empty()) {
+        std::vector<uint8_t> packed(output.end() - decompressed_size, output.end());
+        output.erase(output.end() - decompressed_size, output.end());
+        palette_unpack(packed.data(), packed.size(), header.palette, output);
+        decompressed_size *= 8 / palette_bits(header.palette.size());
+    }
+    if (adaptive && decompressed_size != block_size) {
+        return 0;
+    }
 
-    bool adaptive = block_count > 1;
-    if (adaptive) {
-        output.resize(block_count * BLOCK_BYTE_SIZE);
+    uint8_t* pixels = output.data() + output.size() - decompressed_size;
+    size_t height = adaptive ? width : decompressed_size / width;
+    if (header.model == MODEL_DIFFERENCE) {
+        remove_difference(pixels, width, height, header.near);
+    } else if (header.model == MODEL_WAVELET) {
+        remove_wavelet(pixels, width, height);
     }
 
-    size_t curr_pos = 4;
-    for (size_t i = 0; i < block_count; i++) {
-        bool horizontal = input[curr_pos] & 0x02;
-        bool been_encoded = input[curr_pos] & 0x01;
-        size_t compressed_size = input[curr_pos + 1] | (input[curr_pos + 2] << 8) | (input[curr_pos + 3] << 16) | (input[curr_pos + 4] << 24);
+    if (scan_order != SCAN_ROWS) {
+        unscan_block(pixels, scan_order);
+    } else if (!horizontal) {
+        transpose_block(pixels, width);
+    }
 
-        size_t decompressed_size = compressed_size;
-        std::vector<uint8_t> block_output;
-        std::vector<uint8_t>& output_ref = adaptive ? block_output : output;
+    return compressed_size + BLOCK_HEADER_SIZE;
+}
 
-        if (been_encoded) {
-            decompressed_size = lzss_decompress(input + curr_pos + 5, compressed_size, output_ref);
-        } else {
-            output_ref.resize(compressed_size);
-            std::copy(input + curr_pos + 5, input + curr_pos + 5 + compressed_size, output_ref.begin());
+// Decompress the blocks of the quadtree node at (x, y) of the image
+// into output, following the split bits of tree from bit tree_bits
+// Returns the position after the blocks of the node, 0 if they are invalid
+size_t decompress_node(const uint8_t* input, size_t input_size, size_t pos, const Header& header, uint32_t tree, size_t& tree_bits,
+                       size_t x, size_t y, size_t side, std::vector<uint8_t>& output) {
+    if (side > QUADTREE_MIN_SIZE && ((tree >> tree_bits++) & 1)) {
+        size_t half = side / 2;
+        for (size_t quarter = 0; quarter < 4 && pos != 0; quarter++) {
+            pos = decompress_node(input, input_size, pos, header, tree, tree_bits,
+                                  x + (quarter % 2) * half, y + (quarter / 2) * half, half, output);
         }
+        return pos;
+    }
 
-        size_t height = adaptive ? BLOCK_SIZE : decompressed_size / width;
-        if (model) {
-            remove_difference(output_ref.data() + output_ref.size() - decompressed_size, adaptive ? BLOCK_SIZE : width, height);
+    std::vector<uint8_t> block;
+    size_t block_size = decompress_block(input + pos, input_size - pos, header, side, true, output.data(), nullptr, x, y, block);
+    if (block_size == 0) {
+        return 0;
+    }
+    for (size_t by = 0; by < side; by++) {
+        memcpy(output.data() + (y + by) * header.width + x, block.data() + by * side, side);
+    }
+    return pos + block_size;
+}
+
+// Decompress the planes appended by compress_planes, each on its own thread
+// pos: position of the first plane in the input
+// Returns false if a plane is invalid or the planes differ in size
+bool decompress_planes(const uint8_t* input, size_t input_size, size_t pos, std::vector<uint8_t>* planes, size_t count,
+                       const std::vector<uint8_t>& dictionary) {
+    size_t plane_pos[MAX_CHANNELS], plane_size[MAX_CHANNELS];
+    for (size_t i = 0; i < count; i++) {
+        if (input_size - pos < 4) {
+            return false;
+        }
+        plane_size[i] = input[pos] | input[pos + 1] << 8 | input[pos + 2] << 16 | (size_t)input[pos + 3] << 24;
+        plane_pos[i] = pos + 4;
+        if (plane_size[i] > input_size - plane_pos[i]) {
+            return false;
         }
+        pos = plane_pos[i] + plane_size[i];
+    }
 
-        if (!horizontal) {
-            transpose_block(output_ref.data() + output_ref.size() - decompressed_size);
+    bool valid[MAX_CHANNELS];
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < count; i++) {
+        threads.emplace_back([&, i]() {
+            valid[i] = decompress(input + plane_pos[i], plane_size[i], planes[i], dictionary) != 0;
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!valid[i] || planes[i].size() != planes[0].size()) {
+            return false;
         }
+    }
+    return true;
+}
 
-        // Copy block to the correct position in output
-        if (adaptive) {
-            size_t block_x = (i % (width / BLOCK_SIZE)) * BLOCK_SIZE;
-            size_t block_y = (i / (width / BLOCK_SIZE)) * BLOCK_SIZE;
-
-            for (size_t y = 0; y < BLOCK_SIZE; y++) {
-                std::copy(
-                    block_output.begin() + y * BLOCK_SIZE,
-                    block_output.begin() + (y + 1) * BLOCK_SIZE,
-                    output.begin() + (block_y + y) * width + block_x 
-                );
+size_t decompress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output, const std::vector<uint8_t>& dictionary) {
+    Header header;
+    size_t header_size = read_header(input, input_size, header);
+    if (header_size == 0 || input_size < header_size + 5) {
+        return 0; // Input must contain the header and at least a single block
+    }
+    if (header.dictionary_id != 0) {
+        if (dictionary_id(dictionary) != header.dictionary_id) {
+            return 0; // The dictionary the input was compressed with is needed
+        }
+        header.dictionary = dictionary;
+    }
+
+    if (header.cfa) {
+        std::vector<uint8_t> planes[CFA_PLANES];
+        size_t sample_size = header.bits / 8;
+        if (!decompress_planes(input, input_size, header_size, planes, CFA_PLANES, dictionary)
+            || planes[0].size() % (header.width / 2 * sample_size) != 0
+        ) {
+            return 0;
+        }
+        merge_mosaic(planes, header.width, sample_size, output);
+        return output.size();
+    } else if (header.channels > 1) {
+        std::vector<uint8_t> planes[MAX_CHANNELS];
+        size_t sample_size = header.bits / 8;
+        if (!decompress_planes(input, input_size, header_size, planes, header.channels, dictionary)
+            || planes[0].size() % sample_size != 0
+        ) {
+            return 0;
+        }
+        if (header.color_transform) {
+            remove_color_transform(planes);
+        }
+        interleave_planes(planes, header.channels, sample_size, output);
+        return output.size();
+    } else if (header.bits == 16) {
+        std::vector<uint8_t> planes[2];
+        if (!decompress_planes(input, input_size, header_size, planes, 2, dictionary) || planes[0].size() % header.width != 0) {
+            return 0;
+        }
+        merge_planes(planes[0], planes[1], header.width, header.model == MODEL_DIFFERENCE, output);
+        return output.size();
+    }
+
+    size_t width = header.width;
+    size_t block_count = header.block_count;
+
+    bool adaptive = block_count > 1 || header.quadtree;
+    size_t block_side = header.quadtree ? SUPERBLOCK_SIZE : BLOCK_SIZE;
+
+    // The whole image is a single stream in non-adaptive mode, which
+    // makes row-to-row references possible
+    if (!adaptive) {
+        size_t pixels_per_byte = header.palette.empty() ? 1 : 8 / palette_bits(header.palette.size());
+        header.lzss.stride = width / pixels_per_byte;
+        return decompress_block(input + header_size, input_size - header_size, header, width, false, nullptr, nullptr, 0, 0, output)
+            ? output.size() : 0;
+    }
+
+    size_t frame_size = block_count * block_side * block_side;
+    output.resize(header.frames * frame_size);
+    size_t curr_pos = header_size;
+    for (size_t i = 0; i < header.frames * block_count; i++) {
+        size_t block_x = (i % block_count % (width / block_side)) * block_side;
+        size_t block_y = (i % block_count / (width / block_side)) * block_side;
+        uint8_t* image = output.data() + i / block_count * frame_size;
+
+        if (header.quadtree) {
+            if (input_size - curr_pos < QUADTREE_TREE_SIZE) {
+                return 0;
+            }
+            uint32_t tree = input[curr_pos] | input[curr_pos + 1] << 8 | input[curr_pos + 2] << 16;
+            size_t tree_bits = 0;
+            curr_pos = decompress_node(input, input_size, curr_pos + QUADTREE_TREE_SIZE, header, tree, tree_bits,
+                                       block_x, block_y, SUPERBLOCK_SIZE, output);
+            if (curr_pos == 0) {
+                return 0;
             }
-        } // otherwise the output is already in output
+            continue;
+        }
 
-        curr_pos += compressed_size + 5;
+        std::vector<uint8_t> block_output;
+        size_t block_size = decompress_block(input + curr_pos, input_size - curr_pos, header, BLOCK_SIZE, true,
+                                             image, i >= block_count ? image - frame_size : nullptr, block_x, block_y, block_output);
+        if (block_size == 0) {
+            return 0;
+        }
+
+        // Copy block to the correct position in output
+        for (size_t y = 0; y < BLOCK_SIZE; y++) {
+            std::copy(
+                block_output.begin() + y * BLOCK_SIZE,
+                block_output.begin() + (y + 1) * BLOCK_SIZE,
+                image + (block_y + y) * width + block_x
+            );
+        }
+        curr_pos += block_size;
     }
 
     return output.size();
 }
+
+void dictionary_samples(uint8_t* input, size_t input_size, size_t width, const CompressOptions& options, std::vector<uint8_t>& corpus) {
+    size_t height = input_size / width;
+    if (!options.adaptive) {
+        if (options.model == MODEL_DIFFERENCE) {
+            apply_difference(input, width, height, 0);
+        } else if (options.model == MODEL_WAVELET) {
+            apply_wavelet(input, width, height);
+        }
+        corpus.insert(corpus.end(), input, input + input_size);
+        return;
+    }
+
+    uint8_t block[BLOCK_BYTE_SIZE];
+    for (size_t y = 0; y + BLOCK_SIZE <= height; y += BLOCK_SIZE) {
+        for (size_t x = 0; x + BLOCK_SIZE <= width; x += BLOCK_SIZE) {
+            for (size_t by = 0; by < BLOCK_SIZE; by++) {
+                memcpy(block + by * BLOCK_SIZE, input + (y + by) * width + x, BLOCK_SIZE);
+            }
+            if (options.model == MODEL_DIFFERENCE) {
+                apply_difference(block, BLOCK_SIZE, BLOCK_SIZE, 0);
+            } else if (options.model == MODEL_WAVELET) {
+                apply_wavelet(block, BLOCK_SIZE, BLOCK_SIZE);
+            }
+            corpus.insert(corpus.end(), block, block + BLOCK_BYTE_SIZE);
+        }
+    }
+}
@@ -9,25 +9,89 @@
 #include <vector>
 #include <cstdint>
 #include <cstddef>
+#include "lzss.hpp"
+
+// Models of the image data, stored in the header
+// NONE: the pixels are compressed as they are
+// DIFFERENCE: differences of neighbouring pixels in a row are compressed
+// CONTEXT: the context modeling codec is used instead of LZSS
+// WAVELET: the packed subbands of a 5/3 wavelet transform are compressed
+#define MODEL_NONE 0
+#define MODEL_DIFFERENCE 1
+#define MODEL_CONTEXT 2
+#define MODEL_WAVELET 3
+
+// Largest error bound of the near-lossless mode
+#define MAX_NEAR 32
+
+// Compression settings selected on the command line
+struct CompressOptions {
+    bool adaptive = false; // adaptive scanning mode
+    uint8_t model = MODEL_NONE; // preprocessing model or codec
+    uint8_t format = LZSS_FORMAT_CLASSIC; // LZSS token format
+    size_t window_size = SLIDING_WINDOW_SIZE; // LZSS sliding window size
+    bool match_2d = false; // row-to-row matches in non-adaptive mode
+    uint8_t entropy = LZSS_ENTROPY_NONE; // entropy coder of the SOA streams
+    uint8_t near = 0; // maximum absolute error per pixel, 0 for lossless
+    bool rle = false; // run-length pre-pass before LZSS
+    bool palette = false; // pack images with few gray levels as palette indices
+    bool bitpack = false; // pack residuals at their bit width when it beats LZSS
+    bool scan_curves = false; // also try snake, Hilbert and Z-order scans of adaptive blocks
+    bool quadtree = false; // split adaptive superblocks into blocks of varying size
+    bool prime = false; // prime the LZSS window of adaptive blocks with their neighbour
+    std::vector<uint8_t> dictionary; // preset dictionary preloaded into the LZSS window, empty for none
+    size_t frames = 1; // number of frames of a sequence in adaptive mode, stored one after another
+    uint8_t bits = 8; // bits per sample, 8 or 16 for little-endian 16-bit samples
+    size_t channels = 1; // channels of interleaved pixels, 1, 3 or 4
+    bool color_transform = false; // YCoCg-R transform of the first three channels
+    bool cfa = false; // compress a color filter array mosaic as the four planes of its filter pattern
+};
+
+// Counters of how the blocks were compressed, for debugging output
+struct CompressStats {
+    size_t blocks = 0; // blocks written
+    size_t constant_blocks = 0; // blocks stored as a single value
+    size_t raw_blocks = 0; // blocks stored uncompressed
+    size_t packed_blocks = 0; // blocks packed at the bit width of their residuals
+    size_t duplicate_blocks = 0; // blocks stored as a copy of an earlier block
+    size_t unchanged_blocks = 0; // blocks equal to the previous frame
+    size_t inter_blocks = 0; // blocks stored as their difference from the previous frame
+    size_t curve_blocks = 0; // blocks stored in a space-filling curve scan
+    size_t skipped_trials = 0; // LZSS runs skipped by the incompressibility check
+    size_t skipped_bytes = 0; // bytes the skipped runs would have searched
+};
 
 // Compress the input data
 // input: pointer to the input data read from file
-// input_size: size of the input data
-// width: width of the image from the command line
-// adaptive: true if adaptive scanning mode is used
-// model: true if the preprocessing model is used
+// input_size: size of the input data, the size of all frames of a sequence
+// width: width of the image from the command line, in samples
+// options: scanning mode, preprocessing model and output format
 // output: vector to store the compressed data to be written to file
+// stats: counters updated during compression, can be nullptr
 // Returns the size of the compressed data 
-size_t compress(uint8_t* input, size_t input_size, size_t width, bool adaptive, bool model, std::vector<uint8_t>& output);
+size_t compress(uint8_t* input, size_t input_size, size_t width, const CompressOptions& options, std::vector<uint8_t>& output,
+                CompressStats* stats = nullptr);
 
 // Decompress the input data
 // input: pointer to the input data read from file
 // input_size: size of the input data
 // output: vector to store the decompressed data to be written to file
+// dictionary: preset dictionary the input was compressed with, if any
 // Returns the size of the decompressed data, 0 if input is invalid
+// or the dictionary does not match
 //
-// The function will also handle the adaptive scanning mode and the preprocessing model,
-// these are read from the input data header
-size_t decompress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output);
+// The function will also handle the adaptive scanning mode, the preprocessing model
+// and the output format, these are read from the input data header
+size_t decompress(const uint8_t* input, size_t input_size, std::vector<uint8_t>& output,
+                  const std::vector<uint8_t>& dictionary = std::vector<uint8_t>());
+
+// Append an image to the corpus a dictionary is trained on, as the LZSS
+// stage sees it with the given options in the row scan
+// input: pointer to the image, the model is applied to it in place
+// input_size: size of the image
+// width: width of the image
+// options: scanning mode and preprocessing model
+// corpus: vector the preprocessed image is appended to
+void dictionary_samples(uint8_t* input, size_t input_size, size_t width, const CompressOptions& options, std::vector<uint8_t>& corpus);
 
 #endif
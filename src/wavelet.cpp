@@ -0,0 +1,196 @@
+// wavelet.cpp
+// Source file for the reversible integer 5/3 wavelet transform used
+// as a preprocessing model.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "wavelet.hpp"
+
+// Every lifting step adds a function of the other half of the samples
+// modulo 256, so it is reversible while the coefficients still fit a byte
+// Low-pass samples are read as unsigned and high-pass ones as signed values,
+// the signal is mirrored at the edges
+// The vertical pass works on whole rows at a time so the inner loops run
+// along contiguous memory and vectorize, the horizontal pass transposes
+// the region and runs the vertical pass on it
+
+// Number of levels used for an image of the given size
+static size_t wavelet_levels(size_t width, size_t height) {
+    size_t levels = 0;
+    while (levels < WAVELET_LEVELS && width % 2 == 0 && height % 2 == 0 && width >= 2 && height >= 2) {
+        width /= 2;
+        height /= 2;
+        levels++;
+    }
+    return levels;
+}
+
+// Transpose a width x height region of a buffer with the given stride into
+// a packed height x width destination
+static void transpose_region(const uint8_t* source, size_t stride, size_t width, size_t height, uint8_t* destination) {
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            destination[x * height + y] = source[y * stride + x];
+        }
+    }
+}
+
+// Forward lifting of the rows of a packed width x height region, the even
+// rows end up in the top half and the odd ones in the bottom half
+static void lift_rows(uint8_t* region, size_t width, size_t height, std::vector<uint8_t>& scratch) {
+    size_t half = height / 2;
+    scratch.resize(width * height);
+    uint8_t* low = scratch.data();
+    uint8_t* high = low + half * width;
+    for (size_t i = 0; i < half; i++) {
+        memcpy(low + i * width, region + 2 * i * width, width);
+        memcpy(high + i * width, region + (2 * i + 1) * width, width);
+    }
+
+    for (size_t i = 0; i < half; i++) {
+        const uint8_t* left = low + i * width;
+        const uint8_t* right = low + (i + 1 < half ? i + 1 : i) * width;
+        uint8_t* row = high + i * width;
+        for (size_t x = 0; x < width; x++) {
+            row[x] -= (left[x] + right[x]) >> 1;
+        }
+    }
+    for (size_t i = 0; i < half; i++) {
+        const int8_t* previous = (const int8_t*)high + (i > 0 ? i - 1 : 0) * width;
+        const int8_t* current = (const int8_t*)high + i * width;
+        uint8_t* row = low + i * width;
+        for (size_t x = 0; x < width; x++) {
+            row[x] += (previous[x] + current[x] + 2) >> 2;
+        }
+    }
+
+    memcpy(region, scratch.data(), width * height);
+}
+
+// Inverse of lift_rows
+static void unlift_rows(uint8_t* region, size_t width, size_t height, std::vector<uint8_t>& scratch) {
+    size_t half = height / 2;
+    scratch.assign(region, region + width * height);
+    uint8_t* low = scratch.data();
+    uint8_t* high = low + half * width;
+
+    for (size_t i = 0; i < half; i++) {
+        const int8_t* previous = (const int8_t*)high + (i > 0 ? i - 1 : 0) * width;
+        const int8_t* current = (const int8_t*)high + i * width;
+        uint8_t* row = low + i * width;
+        for (size_t x = 0; x < width; x++) {
+            row[x] -= (previous[x] + current[x] + 2) >> 2;
+        }
+    }
+    for (size_t i = 0; i < half; i++) {
+        const uint8_t* left = low + i * width;
+        const uint8_t* right = low + (i + 1 < half ? i + 1 : i) * width;
+        uint8_t* row = high + i * width;
+        for (size_t x = 0; x < width; x++) {
+            row[x] += (left[x] + right[x]) >> 1;
+        }
+    }
+
+    for (size_t i = 0; i < half; i++) {
+        memcpy(region + 2 * i * width, low + i * width, width);
+        memcpy(region + (2 * i + 1) * width, high + i * width, width);
+    }
+}
+
+// Copy the subbands between the in-place layout, where every level splits
+// the low-pass quadrant in the top left corner, and the packed layout
+static void pack_subbands(uint8_t* buffer, size_t width, size_t height, size_t levels, bool pack) {
+    std::vector<uint8_t> packed(width * height);
+    size_t pos = 0;
+    auto copy_band = [&](size_t x0, size_t y0, size_t band_width, size_t band_height) {
+        for (size_t y = 0; y < band_height; y++) {
+            uint8_t* in_place = buffer + (y0 + y) * width + x0;
+            if (pack) {
+                memcpy(packed.data() + pos, in_place, band_width);
+            } else {
+                memcpy(in_place, packed.data() + pos, band_width);
+            }
+            pos += band_width;
+        }
+    };
+
+    if (!pack) {
+        packed.assign(buffer, buffer + width * height);
+    }
+    size_t band_width = width >> levels, band_height = height >> levels;
+    copy_band(0, 0, band_width, band_height);
+    for (size_t level = levels; level > 0; level--) {
+        copy_band(band_width, 0, band_width, band_height);
+        copy_band(0, band_height, band_width, band_height);
+        copy_band(band_width, band_height, band_width, band_height);
+        band_width *= 2;
+        band_height *= 2;
+    }
+    if (pack) {
+        memcpy(buffer, packed.data(), width * height);
+    }
+}
+
+// Replace every sample of the packed low-pass band with its difference from
+// the one to the left, the first column from the one above, or revert that
+// The band is a downscaled copy of the image, so it correlates like one
+static void difference_low_band(uint8_t* band, size_t width, size_t height, bool forward) {
+    if (forward) {
+        for (size_t i = width * height; i-- > 1;) {
+            band[i] -= band[i % width ? i - 1 : i - width];
+        }
+    } else {
+        for (size_t i = 1; i < width * height; i++) {
+            band[i] += band[i % width ? i - 1 : i - width];
+        }
+    }
+}
+
+void apply_wavelet(uint8_t* buffer, size_t width, size_t height) {
+    size_t levels = wavelet_levels(width, height);
+    std::vector<uint8_t> region, scratch;
+    for (size_t level = 0, w = width, h = height; level < levels; level++, w /= 2, h /= 2) {
+        region.resize(w * h);
+        for (size_t y = 0; y < h; y++) {
+            memcpy(region.data() + y * w, buffer + y * width, w);
+        }
+        lift_rows(region.data(), w, h, scratch);
+
+        std::vector<uint8_t> transposed(w * h);
+        transpose_region(region.data(), w, w, h, transposed.data());
+        lift_rows(transposed.data(), h, w, scratch);
+        transpose_region(transposed.data(), h, h, w, region.data());
+
+        for (size_t y = 0; y < h; y++) {
+            memcpy(buffer + y * width, region.data() + y * w, w);
+        }
+    }
+    pack_subbands(buffer, width, height, levels, true);
+    difference_low_band(buffer, width >> levels, height >> levels, true);
+}
+
+void remove_wavelet(uint8_t* buffer, size_t width, size_t height) {
+    size_t levels = wavelet_levels(width, height);
+    difference_low_band(buffer, width >> levels, height >> levels, false);
+    pack_subbands(buffer, width, height, levels, false);
+    std::vector<uint8_t> region, scratch;
+    for (size_t level = levels; level-- > 0;) {
+        size_t w = width >> level, h = height >> level;
+        region.resize(w * h);
+        for (size_t y = 0; y < h; y++) {
+            memcpy(region.data() + y * w, buffer + y * width, w);
+        }
+
+        std::vector<uint8_t> transposed(w * h);
+        transpose_region(region.data(), w, w, h, transposed.data());
+        unlift_rows(transposed.data(), h, w, scratch);
+        transpose_region(transposed.data(), h, h, w, region.data());
+        unlift_rows(region.data(), w, h, scratch);
+
+        for (size_t y = 0; y < h; y++) {
+            memcpy(buffer + y * width, region.data() + y * w, w);
+        }
+    }
+}
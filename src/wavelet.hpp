@@ -0,0 +1,24 @@
+// wavelet.hpp
+// Header file for the reversible integer 5/3 wavelet transform used
+// as a preprocessing model.
+
+#ifndef WAVELET_HPP
+#define WAVELET_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// Number of decomposition levels, fewer are used if a dimension gets odd
+#define WAVELET_LEVELS 3
+
+// Transform the image in place, the subbands are packed one after another
+// starting with the lowest frequencies
+// buffer: pointer to the pixels, stored row by row
+// width: width of the image
+// height: height of the image
+void apply_wavelet(uint8_t* buffer, size_t width, size_t height);
+
+// Reverse apply_wavelet in place
+void remove_wavelet(uint8_t* buffer, size_t width, size_t height);
+
+#endif
@@ -23,7 +23,7 @@ echo "------------------------------------------"
 echo -e "${BLUE}Running tests for lz_codec${NC}"
 echo "------------------------------------------"
 
-POSSIBLEFLAGS=("" "-m" "-a" "-ma")
+POSSIBLEFLAGS=("" "-m" "-a" "-ma" "-ma --tokens varlen" "-m --tokens soa" "-m --window 65536" "-m --2d" "-ma --entropy huffman" "-m --entropy rans" "-a --context" "-m --wavelet" "-m --rle" "-a --palette" "-ma --bitpack" "-ma --curves" "-ma --quadtree" "-ma --prime" "-ma --frames 2" "-ma --cfa" "-ma --bits 16")
 ALLFILES=()
 
 for file in data/*.raw
@@ -87,6 +87,104 @@ do
     done
 done
 
+# train a preset dictionary on all the files and use it for the first one
+DICTFILES=()
+for file in "${ALLFILES[@]}"
+do
+    DICTFILES+=("-i" "$file")
+done
+if [ ${#ALLFILES[@]} -gt 0 ]
+then
+    rm -f dictionary.tmp compressed.tmp decompressed.tmp
+    file=${ALLFILES[0]}
+    echo "Running test for $file with a trained dictionary"
+    ./lz_codec --train-dict -w 512 "${DICTFILES[@]}" -o dictionary.tmp \
+        && ./lz_codec -c -i $file -o compressed.tmp -w 512 -ma -D dictionary.tmp \
+        && ./lz_codec -d -i compressed.tmp -o decompressed.tmp -D dictionary.tmp
+    if [ $? -ne 0 ]
+    then
+        echo -e "${RED}Test failed on ${ORANGE}execution of dictionary training or coding${NC}"
+    elif diff $file decompressed.tmp > /dev/null
+    then
+        TESTSPASSED=$((TESTSPASSED+1))
+        echo -e "${GREEN}Test passed${NC}"
+    else
+        echo -e "${RED}Test failed${NC}"
+    fi
+    TESTSRUN=$((TESTSRUN+1))
+    echo "------------------------------------------"
+    rm -f dictionary.tmp
+fi
+
+# code the first file as 256 pixels wide with 4 interleaved channels, and check
+# that the color transform is refused in near-lossless mode
+if [ ${#ALLFILES[@]} -gt 0 ]
+then
+    rm -f compressed.tmp decompressed.tmp
+    file=${ALLFILES[0]}
+    flag="-ma --channels 4 --ycocg"
+    echo "Running test for $file with flags -w 256 $flag"
+    ./lz_codec -c -i $file -o compressed.tmp -w 256 $flag \
+        && ./lz_codec -d -i compressed.tmp -o decompressed.tmp $flag
+    if [ $? -ne 0 ]
+    then
+        echo -e "${RED}Test failed on ${ORANGE}execution of compression or decompression${NC}"
+    elif diff $file decompressed.tmp > /dev/null
+    then
+        TESTSPASSED=$((TESTSPASSED+1))
+        echo -e "${GREEN}Test passed${NC}"
+    else
+        echo -e "${RED}Test failed${NC}"
+    fi
+    TESTSRUN=$((TESTSRUN+1))
+    echo "------------------------------------------"
+
+    echo "Running test for $file with flags -w 256 $flag --near 2"
+    if ./lz_codec -c -i $file -o compressed.tmp -w 256 $flag --near 2 > /dev/null 2>&1
+    then
+        echo -e "${RED}Test failed on ${ORANGE}the color transform being accepted in near-lossless mode${NC}"
+    else
+        TESTSPASSED=$((TESTSPASSED+1))
+        echo -e "${GREEN}Test passed${NC}"
+    fi
+    TESTSRUN=$((TESTSRUN+1))
+    echo "------------------------------------------"
+fi
+
+# repeated noise only compresses through matches the incompressibility check
+# can not see, each case is the file, its width and the flags, the file must
+# shrink, the last one only repeats the dictionary trained on the tiles
+head -c 4096 /dev/urandom > noise.tmp
+for i in $(seq 256); do cat noise.tmp; done > rows.tmp
+head -c 65536 /dev/urandom > noise.tmp
+cat noise.tmp noise.tmp noise.tmp noise.tmp > tiles.tmp
+./lz_codec --train-dict -w 512 -i tiles.tmp -o dictionary.tmp --window 65536
+REPEATCASES=("rows.tmp|4096|-m --2d" "tiles.tmp|512|-m --window 65536" "noise.tmp|256|-a --window 65536 -D dictionary.tmp")
+for case in "${REPEATCASES[@]}"
+do
+    IFS='|' read -r file width flag <<< "$case"
+    rm -f compressed.tmp decompressed.tmp
+    echo "Running test for repeated noise in $file with flags $flag"
+    ./lz_codec -c -i $file -o compressed.tmp -w $width $flag \
+        && ./lz_codec -d -i compressed.tmp -o decompressed.tmp $flag
+    if [ $? -ne 0 ]
+    then
+        echo -e "${RED}Test failed on ${ORANGE}execution of compression or decompression${NC}"
+    elif ! diff $file decompressed.tmp > /dev/null
+    then
+        echo -e "${RED}Test failed${NC}"
+    elif [ $(stat -c%s compressed.tmp) -ge $(($(stat -c%s $file) / 2)) ]
+    then
+        echo -e "${RED}Test failed on ${ORANGE}the repeats not being found${NC}"
+    else
+        TESTSPASSED=$((TESTSPASSED+1))
+        echo -e "${GREEN}Test passed${NC}"
+    fi
+    TESTSRUN=$((TESTSRUN+1))
+    echo "------------------------------------------"
+done
+rm -f noise.tmp rows.tmp tiles.tmp dictionary.tmp
+
 echo "Tests run: $TESTSRUN"
 echo "Tests passed: $TESTSPASSED"
 echo "------------------------------------------"